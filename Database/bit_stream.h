@@ -0,0 +1,88 @@
+#ifndef DAI_BIT_STREAM_H
+#define DAI_BIT_STREAM_H
+
+#include <QByteArray>
+
+namespace Dai {
+
+class BitWriter
+{
+public:
+    void writeBit(bool bit)
+    {
+        if (bit_pos_ == 0)
+            data_.append('\0');
+        if (bit)
+            data_[data_.size() - 1] = data_.at(data_.size() - 1) | static_cast<char>(0x80 >> bit_pos_);
+        bit_pos_ = (bit_pos_ + 1) & 7;
+    }
+
+    void writeBits(quint64 value, int count)
+    {
+        while (count--)
+            writeBit((value >> count) & 1);
+    }
+
+    const QByteArray& data() const { return data_; }
+private:
+    QByteArray data_;
+    int bit_pos_ = 0;
+};
+
+class BitReader
+{
+public:
+    explicit BitReader(const QByteArray& data) : data_(data) {}
+
+    bool atEnd() const { return pos_ >= data_.size() * 8; }
+
+    bool readBit()
+    {
+        if (atEnd())
+            return false;
+        bool bit = (static_cast<uchar>(data_.at(pos_ >> 3)) >> (7 - (pos_ & 7))) & 1;
+        ++pos_;
+        return bit;
+    }
+
+    quint64 readBits(int count)
+    {
+        quint64 value = 0;
+        while (count--)
+            value = (value << 1) | readBit();
+        return value;
+    }
+private:
+    const QByteArray& data_;
+    int pos_ = 0;
+};
+
+inline quint64 zigzagEncode(qint64 value) { return (static_cast<quint64>(value) << 1) ^ static_cast<quint64>(value >> 63); }
+inline qint64 zigzagDecode(quint64 value) { return static_cast<qint64>(value >> 1) ^ -static_cast<qint64>(value & 1); }
+
+inline void writeVarint(QByteArray& data, quint64 value)
+{
+    while (value >= 0x80)
+    {
+        data.append(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    data.append(static_cast<char>(value));
+}
+
+inline bool readVarint(const QByteArray& data, int& pos, quint64& value)
+{
+    value = 0;
+    for (int shift = 0; pos < data.size() && shift < 64; shift += 7)
+    {
+        uchar byte = static_cast<uchar>(data.at(pos++));
+        value |= static_cast<quint64>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+} // namespace Dai
+
+#endif // DAI_BIT_STREAM_H
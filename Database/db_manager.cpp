@@ -1,22 +1,121 @@
 #include <QSqlQuery>
 #include <QSqlResult>
 #include <QSqlRecord>
+#include <QSqlError>
 #include <QVariant>
+#include <QDir>
 #include <QDebug>
 
 #include <memory>
+#include <algorithm>
 
 #include <Dai/project.h>
 
 #include "Network/n_client.h"
+#include "log_value_store.h"
+#include "log_archive.h"
 #include "db_manager.h"
 
 namespace Dai {
 
+#define LOG_RANGE_MAX_COUNT     10000
+
 DBManager::DBManager(const Helpz::Database::ConnectionInfo &info, const QString &name) :
     Database(info, name)
 {
     qRegisterMetaType<Dai::DBManager::LogDataT>("Dai::DBManager::LogDataT");
+
+    log_rollup_.reset(new LogRollup(db()));
+
+    // Эмулятор создаёт менеджер без подключения и подключается позже
+    if (db().isOpen())
+    {
+        log_rollup_->createTable();
+        loadSyncCursors();
+    }
+}
+
+DBManager::~DBManager() {}
+
+bool DBManager::initLogStore(const QString &path, qint64 segment_size, int max_segments, int max_mapped)
+{
+    quint32 last_id = 0;
+    auto q = exec("SELECT MAX(id) FROM house_logs");
+    if (q.isActive() && q.next())
+        last_id = q.value(0).toUInt();
+
+    std::unique_ptr<LogValueStore> store(new LogValueStore(path, segment_size, max_segments, max_mapped));
+    if (!store->open(last_id))
+        return false;
+
+    log_store_ = std::move(store);
+    return true;
+}
+
+void DBManager::retireLogStore(const QString &path, qint64 segment_size)
+{
+    if (QDir(path).entryList({"*.dls"}, QDir::Files).isEmpty())
+        return;
+
+    LogValueStore store(path, segment_size);
+    if (!store.open())
+        return;
+
+    auto q = exec("SELECT MAX(id) FROM house_logs");
+    if (!q.isActive() || !q.next() || q.value(0).toUInt() >= store.lastId())
+        return;
+
+    // Id хранилища уже ушли на сервер. Последняя запись хранилища копируется в базу
+    // с тем же id, тогда автоинкремент продолжит после неё и после перезапуска MySQL
+    QVector<ValuePackItem> last;
+    store.read({store.lastId(), store.lastId()}, [&last](const ValuePackItem& item) { last.push_back(item); });
+    if (last.isEmpty())
+    {
+        qWarning() << "Can't read last record of value log store" << path;
+        return;
+    }
+
+    QSqlQuery insert_q(db());
+    insert_q.prepare("INSERT INTO house_logs (id, item_id, date, raw_value, value) VALUES (?, ?, ?, ?, ?)");
+    insert_q.addBindValue(last.front().id);
+    insert_q.addBindValue(last.front().item_id);
+    insert_q.addBindValue(QDateTime::fromMSecsSinceEpoch(last.front().time_msecs));
+    insert_q.addBindValue(last.front().raw_value);
+    insert_q.addBindValue(last.front().value);
+    if (!insert_q.exec())
+        qWarning() << "Can't continue log ids after value log store" << insert_q.lastError().text();
+}
+
+bool DBManager::logValue(DeviceItem *item, const QDateTime &date, QVariant *db_id)
+{
+    if (!log_store_)
+        return logChanges(item, date, db_id);
+
+    quint32 id;
+    if (!log_store_->append(item->id(), date.toMSecsSinceEpoch(), item->getRawValue(), item->getValue(), &id))
+        return false;
+
+    if (db_id)
+        *db_id = id;
+    return true;
+}
+
+void DBManager::setLogArchive(std::shared_ptr<LogArchive> archive)
+{
+    log_archive_ = std::move(archive);
+}
+
+void DBManager::rollupValue(quint32 item_id, qint64 time_ms, const QVariant &value)
+{
+    bool ok;
+    double number = value.toDouble(&ok);
+    if (ok && value.isValid())
+        log_rollup_->add(item_id, time_ms, number);
+}
+
+QVector<LogRollup::Point> DBManager::getLogRollup(quint32 item_id, qint64 from_ms, qint64 to_ms, qint64 step_ms)
+{
+    return log_rollup_->query(item_id, from_ms, to_ms, step_ms);
 }
 
 bool DBManager::setDayTime(uint id, const TimeRange &range)
@@ -62,33 +161,116 @@ void DBManager::saveCode(uint type, const QString &code)
 
 // -----> Sync database
 
-DBManager::LogDataT DBManager::getLogData(quint8 log_type, const QPair<quint32, quint32> &range)
+void DBManager::getLogRangeValues(const QString &sql, const QPair<quint32, quint32> &range, QVector<quint32> &not_found,
+                                  const std::function<void (const QSqlQuery &)> &callback)
 {
-    LogDataT res;
+    quint32 id, next_id = range.first;
 
-    auto getLogRangeValues = [&](const Helpz::Database::Table &table, std::function<void(const QSqlQuery&)> callback)
+    QSqlQuery q(db());
+    q.setForwardOnly(true);
+    q.prepare(sql + " WHERE id >= ? AND id <= ? ORDER BY id");
+    q.addBindValue(range.first);
+    q.addBindValue(range.second);
+    if (q.exec())
+        while(q.next())
+        {
+            id = q.value(0).toUInt();
+            while (next_id < id)
+                not_found.push_back(next_id++);
+            ++next_id;
+
+            callback(q);
+        }
+}
+
+void DBManager::getLogValues(const QPair<quint32, quint32> &range, QVector<ValuePackItem> &pack, QVector<quint32> &not_found)
+{
+    const int pack_size = pack.size();
+    getLogRangeValues("SELECT id, item_id, date, raw_value, value FROM house_logs", range, not_found, [&pack](const QSqlQuery& q) {
+        pack.push_back(ValuePackItem{ q.value(0).toUInt(), q.value(1).toUInt(),
+                                 q.value(2).toDateTime().toMSecsSinceEpoch(), q.value(3), q.value(4)});
+    });
+
+    // Последних id тоже нет в ответе базы, если они уже в архиве
+    if (log_archive_)
     {
-        quint32 id, next_id = range.first;
-        auto q = select(table, QString("WHERE id >= %1 AND id <= %2").arg(range.first).arg(range.second));
-        if (q.isActive())
-            while(q.next())
+        const quint32 archive_max_id = std::min(range.second, log_archive_->maxId());
+        quint32 last_id = pack.size() == pack_size ? range.first : pack.back().id + 1;
+        while (last_id <= archive_max_id && last_id >= range.first)
+            not_found.push_back(last_id++);
+    }
+
+    if (log_archive_ && !not_found.isEmpty())
+    {
+        QVector<ValuePackItem> archived = log_archive_->read({not_found.front(), not_found.back()});
+        if (!archived.isEmpty())
+        {
+            QVector<quint32> still_not_found;
+            auto arch_it = archived.cbegin();
+            for (quint32 id: not_found)
             {
-                id = q.value(0).toUInt();
-                while (next_id < id)
-                    res.not_found.push_back(next_id++);
-                ++next_id;
+                while (arch_it != archived.cend() && arch_it->id < id)
+                    ++arch_it;
 
-                callback(q);
+                if (arch_it != archived.cend() && arch_it->id == id)
+                    pack.push_back(*arch_it);
+                else
+                    still_not_found.push_back(id);
             }
-    };
+            not_found = std::move(still_not_found);
+
+            std::sort(pack.begin(), pack.end(), [](const ValuePackItem& a, const ValuePackItem& b) { return a.id < b.id; });
+        }
+    }
+}
+
+DBManager::LogDataT DBManager::getLogData(const QString &upstream, quint8 log_type, const QPair<quint32, quint32> &range)
+{
+    LogDataT res;
+    qint64 max_date_ms = 0;
+    const quint32 store_first = log_type == ValueLog && log_store_ ? log_store_->firstId() : 0;
 
     switch (log_type) {
     case ValueLog: {
         QVector<ValuePackItem> pack;
-        getLogRangeValues({"house_logs", {"id", "item_id", "date", "raw_value", "value"}}, [&pack](const QSqlQuery& q) {
-            pack.push_back(ValuePackItem{ q.value(0).toUInt(), q.value(1).toUInt(),
-                                     q.value(2).toDateTime().toMSecsSinceEpoch(), q.value(3), q.value(4)});
-        });
+        if (store_first && range.second >= store_first)
+        {
+            // Записи до начала хранилища лежат в базе и архиве
+            if (range.first < store_first)
+                getLogValues({range.first, store_first - 1}, pack, res.not_found);
+
+            QVector<quint32> missing;
+            const QPair<quint32, quint32> store_range{ std::max(range.first, store_first), range.second };
+            quint32 next_id = store_range.first;
+            log_store_->read(store_range, [&](const ValuePackItem& item) {
+                while (next_id < item.id)
+                    missing.push_back(next_id++);
+                ++next_id;
+
+                pack.push_back(item);
+            });
+            while (next_id <= std::min(store_range.second, log_store_->lastId()) && next_id >= store_range.first)
+                missing.push_back(next_id++);
+
+            // Промежутки между сегментами, например после переполнения.
+            // В базе ищутся только сами промежутки, записи хранилища между ними не читаются
+            for (int i = 0; i < missing.size(); )
+            {
+                int j = i + 1;
+                while (j < missing.size() && missing.at(j) == missing.at(j - 1) + 1)
+                    ++j;
+                getLogValues({missing.at(i), missing.at(j - 1)}, pack, res.not_found);
+                i = j;
+            }
+
+            std::sort(pack.begin(), pack.end(), [](const ValuePackItem& a, const ValuePackItem& b) { return a.id < b.id; });
+        }
+        else
+            getLogValues(range, pack, res.not_found);
+
+        for (const auto& item: pack)
+            if (!store_first || item.id < store_first)
+                max_date_ms = std::max(max_date_ms, item.time_msecs);
 #if (__cplusplus > 201402L) && (!defined(__GNUC__) || (__GNUC__ >= 7))
         res.data = std::move(pack);
 #else
@@ -98,10 +280,12 @@ DBManager::LogDataT DBManager::getLogData(quint8 log_type, const QPair<quint32,
     }
     case EventLog: {
         QVector<EventPackItem> pack;
-        getLogRangeValues({"house_eventlog", {"id", "type", "date", "who", "msg"}}, [&pack](const QSqlQuery& q) {
+        getLogRangeValues("SELECT id, type, date, who, msg FROM house_eventlog", range, res.not_found, [&pack](const QSqlQuery& q) {
             pack.push_back(EventPackItem{ q.value(0).toUInt(), q.value(1).toUInt(),
                                      q.value(2).toDateTime().toMSecsSinceEpoch(), q.value(3).toString(), q.value(4).toString()});
         });
+        for (const auto& item: pack)
+            max_date_ms = std::max(max_date_ms, item.time_msecs);
 #if (__cplusplus > 201402L) && (!defined(__GNUC__) || (__GNUC__ >= 7))
         res.data = std::move(pack);
 #else
@@ -112,39 +296,127 @@ DBManager::LogDataT DBManager::getLogData(quint8 log_type, const QPair<quint32,
     default:
         break;
     }
+
+    // Курсор относится только к журналу в базе
+    SyncCursor& cursor = sync_cursors_[std::make_pair(upstream, log_type)];
+    cursor.served_id = store_first ? std::min(range.second, store_first - 1) : range.second;
+    cursor.served_date_ms = max_date_ms;
     return res;
 }
 
-QPair<quint32, quint32> DBManager::getLogRange(quint8 log_type, qint64 date_ms)
+QPair<quint32, quint32> DBManager::getLogRange(const QString &upstream, quint8 log_type, qint64 date_ms)
+{
+    if (log_type != ValueLog || !log_store_)
+        return getLogRangeFromDb(upstream, log_type, date_ms);
+
+    // Старые записи из базы и архива отдаются раньше записей хранилища
+    QPair<quint32, quint32> store_range = log_store_->range(date_ms);
+    QPair<quint32, quint32> db_range = getLogRangeFromDb(upstream, log_type, date_ms);
+    if (db_range.first && (!store_range.first || db_range.first < store_range.first))
+    {
+        if (store_range.first && db_range.second >= store_range.first)
+            db_range.second = store_range.first - 1;
+        return db_range;
+    }
+    return store_range;
+}
+
+QPair<quint32, quint32> DBManager::getLogRangeFromDb(const QString &upstream, quint8 log_type, qint64 date_ms)
 {
-    QString tableName = logTableName(log_type);
+    if (log_type == ValueLog && log_archive_ && date_ms < log_archive_->endTime())
+    {
+        QPair<quint32, quint32> range = log_archive_->range(date_ms);
+        if (range.first)
+            return range;
+    }
 
-    QString where;
-    QVariantList values;
+    const QString table_name = logTableName(log_type);
+    SyncCursor& cursor = sync_cursors_[std::make_pair(upstream, log_type)];
+
+    // Сервер просит записи новее всего, что получил, значит последний отданный ему диапазон подтверждён
+    if (cursor.served_id > cursor.last_id && date_ms >= cursor.served_date_ms)
+    {
+        cursor.last_id = cursor.served_id;
+        cursor.date_ms = cursor.served_date_ms;
+        saveSyncCursor(upstream, log_type, cursor);
+    }
 
     QDateTime date = QDateTime::fromMSecsSinceEpoch(date_ms);
-    if (date_ms > 0 && date.isValid()) {
-        where = "WHERE date > ? ";
-        values.push_back(date);
+    if (date_ms <= 0 || !date.isValid())
+        date = QDateTime::fromMSecsSinceEpoch(0);
+
+    QSqlQuery q(db());
+    q.setForwardOnly(true);
+
+    // Если курсор покрывает запрошенную дату, всё до курсора у сервера уже есть,
+    // и первый id ищется по первичному ключу только среди записей после курсора.
+    // Условие по дате то же, что и без курсора: записи не новее date серверу не нужны
+    if (cursor.last_id && date_ms >= cursor.date_ms)
+    {
+        q.prepare(QString("SELECT id FROM %1 WHERE id > ? AND date > ? ORDER BY id ASC LIMIT 1").arg(table_name));
+        q.addBindValue(cursor.last_id);
+        q.addBindValue(date);
+    }
+    else
+    {
+        q.prepare(QString("SELECT id FROM %1 WHERE date > ? ORDER BY date ASC LIMIT 1").arg(table_name));
+        q.addBindValue(date);
     }
-    where += "ORDER BY date ASC LIMIT 10000;";
 
-    uint32_t start = 0, end = 0, id;
+    if (!q.exec() || !q.next())
+        return {0, 0};
+
+    const quint32 start = q.value(0).toUInt();
+    quint32 end = start + (LOG_RANGE_MAX_COUNT - 1);
+
+    // Первый id окна, за которым нет следующего
+    q.prepare(QString("SELECT MIN(t1.id) FROM %1 t1 LEFT JOIN %1 t2 ON t2.id = t1.id + 1 "
+                      "WHERE t1.id >= ? AND t1.id < ? AND t2.id IS NULL").arg(table_name));
+    q.addBindValue(start);
+    q.addBindValue(end);
+    if (q.exec() && q.next() && !q.value(0).isNull())
+        end = q.value(0).toUInt();
 
-    QSqlQuery q = select({tableName, {"id"}}, where, values);
-    if (q.isActive())
-        while(q.next()) {
-            id = q.value(0).value<uint32_t>();
-            if (start == 0)
-                start = end = id;
-            else if (id == (end + 1))
-                ++end;
-            else
-                break;
-        }
     return {start, end};
 }
 
+void DBManager::loadSyncCursors()
+{
+    QSqlQuery q(db());
+    if (!q.exec("CREATE TABLE IF NOT EXISTS house_sync_cursor ("
+                "upstream VARCHAR(255) NOT NULL, "
+                "log_type TINYINT UNSIGNED NOT NULL, "
+                "last_id INT UNSIGNED NOT NULL, "
+                "date BIGINT NOT NULL, "
+                "PRIMARY KEY (upstream, log_type))"))
+    {
+        qWarning() << "Can't create sync cursor table" << q.lastError().text();
+        return;
+    }
+
+    if (q.exec("SELECT upstream, log_type, last_id, date FROM house_sync_cursor"))
+        while (q.next())
+        {
+            SyncCursor& cursor = sync_cursors_[std::make_pair(q.value(0).toString(), static_cast<quint8>(q.value(1).toUInt()))];
+            cursor.last_id = q.value(2).toUInt();
+            cursor.date_ms = q.value(3).toLongLong();
+        }
+    else
+        qWarning() << "Can't load sync cursors" << q.lastError().text();
+}
+
+void DBManager::saveSyncCursor(const QString &upstream, quint8 log_type, const SyncCursor& cursor)
+{
+    QSqlQuery q(db());
+    q.prepare("REPLACE INTO house_sync_cursor (upstream, log_type, last_id, date) VALUES (?, ?, ?, ?)");
+    q.addBindValue(upstream);
+    q.addBindValue(log_type);
+    q.addBindValue(cursor.last_id);
+    q.addBindValue(cursor.date_ms);
+    if (!q.exec())
+        qWarning() << "Can't save sync cursor" << upstream << log_type << q.lastError().text();
+}
+
 // <--------------------
 
 } // namespace Dai
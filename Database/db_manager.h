@@ -2,6 +2,8 @@
 #define DATABASE_MANAGER_H
 
 #include <functional>
+#include <map>
+#include <memory>
 
 #if (__cplusplus > 201402L) && (!defined(__GNUC__) || (__GNUC__ >= 7))
 #include <variant>
@@ -12,15 +14,32 @@
 #include <Dai/logpack.h>
 #include <plus/dai/database.h>
 
+#include "log_rollup.h"
+
+class QSqlQuery;
+
 namespace Dai {
 
+class LogValueStore;
+class LogArchive;
+
 class DBManager : public Database
 {
     Q_OBJECT
 public:
     DBManager(const Helpz::Database::ConnectionInfo &info = {{}, {}, {}}, const QString& name = {});
+    ~DBManager();
 //    using Database::Database;
 
+    bool initLogStore(const QString& path, qint64 segment_size, int max_segments, int max_mapped);
+    // Хранилище выключено: id журнала в базе продолжаются после его последней записи
+    void retireLogStore(const QString& path, qint64 segment_size);
+    bool logValue(DeviceItem* item, const QDateTime& date, QVariant* db_id);
+    void setLogArchive(std::shared_ptr<LogArchive> archive);
+
+    void rollupValue(quint32 item_id, qint64 time_ms, const QVariant& value);
+    QVector<LogRollup::Point> getLogRollup(quint32 item_id, qint64 from_ms, qint64 to_ms, qint64 step_ms);
+
     bool setDayTime(uint id, const TimeRange& range);
     void getListValues(const QVector<quint32> &ids, QVector<quint32> &found, QVector<ValuePackItem> &pack);
 
@@ -37,9 +56,33 @@ public:
 #endif
     };
 
-    Dai::DBManager::LogDataT getLogData(quint8 log_type, const QPair<quint32, quint32> &range);
-    QPair<quint32, quint32> getLogRange(quint8 log_type, qint64 date_ms);
+    // upstream - сервер, которому отдаётся журнал, у каждого свой курсор синхронизации
+    Dai::DBManager::LogDataT getLogData(const QString& upstream, quint8 log_type, const QPair<quint32, quint32> &range);
+    QPair<quint32, quint32> getLogRange(const QString& upstream, quint8 log_type, qint64 date_ms);
 // <--------------------
+private:
+    void getLogRangeValues(const QString& sql, const QPair<quint32, quint32> &range, QVector<quint32>& not_found,
+                           const std::function<void(const QSqlQuery&)>& callback);
+    // Журнал значений из базы и архива
+    void getLogValues(const QPair<quint32, quint32> &range, QVector<ValuePackItem>& pack, QVector<quint32>& not_found);
+    QPair<quint32, quint32> getLogRangeFromDb(const QString& upstream, quint8 log_type, qint64 date_ms);
+
+    struct SyncCursor {
+        quint32 last_id = 0;
+        qint64 date_ms = 0;
+
+        quint32 served_id = 0;
+        qint64 served_date_ms = 0;
+    };
+
+    void loadSyncCursors();
+    void saveSyncCursor(const QString& upstream, quint8 log_type, const SyncCursor& cursor);
+
+    std::map<std::pair<QString, quint8>, SyncCursor> sync_cursors_;
+
+    std::unique_ptr<LogValueStore> log_store_;
+    std::shared_ptr<LogArchive> log_archive_;
+    std::unique_ptr<LogRollup> log_rollup_;
 };
 
 } // namespace Dai
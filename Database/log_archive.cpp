@@ -0,0 +1,614 @@
+#include <algorithm>
+#include <cstring>
+
+#include <QDir>
+#include <QDebug>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QtAlgorithms>
+
+#include "bit_stream.h"
+#include "log_archive.h"
+
+namespace Dai {
+
+namespace {
+
+const quint32 archive_magic = 0x444C4131; // DLA1
+const quint32 archive_version = 1;
+const int max_block_count = 1024;
+
+enum ColumnType : quint8 {
+    ctXorDouble = 0,
+    ctVariant
+};
+
+// ----> Timestamps: delta of delta
+void encodeTimes(BitWriter& bits, const ValuePackItem* begin, const ValuePackItem* end)
+{
+    qint64 prev_time = begin->time_msecs, prev_delta = 0, delta, dod;
+    for (const ValuePackItem* it = begin + 1; it < end; ++it)
+    {
+        delta = it->time_msecs - prev_time;
+        dod = delta - prev_delta;
+        prev_time = it->time_msecs;
+        prev_delta = delta;
+
+        if (dod == 0)
+            bits.writeBit(0);
+        else if (dod >= -63 && dod <= 64)
+        {
+            bits.writeBits(0b10, 2);
+            bits.writeBits(dod + 63, 7);
+        }
+        else if (dod >= -255 && dod <= 256)
+        {
+            bits.writeBits(0b110, 3);
+            bits.writeBits(dod + 255, 9);
+        }
+        else if (dod >= -2047 && dod <= 2048)
+        {
+            bits.writeBits(0b1110, 4);
+            bits.writeBits(dod + 2047, 12);
+        }
+        else if (dod >= -2147483647LL && dod <= 2147483648LL)
+        {
+            bits.writeBits(0b11110, 5);
+            bits.writeBits(dod + 2147483647LL, 32);
+        }
+        else
+        {
+            bits.writeBits(0b11111, 5);
+            bits.writeBits(static_cast<quint64>(dod), 64);
+        }
+    }
+}
+
+void decodeTimes(BitReader& bits, QVector<ValuePackItem>& items, qint64 first_time)
+{
+    qint64 prev_time = first_time, prev_delta = 0, dod;
+    for (int i = 0; i < items.size(); ++i)
+    {
+        if (i != 0)
+        {
+            if (!bits.readBit())
+                dod = 0;
+            else if (!bits.readBit())
+                dod = static_cast<qint64>(bits.readBits(7)) - 63;
+            else if (!bits.readBit())
+                dod = static_cast<qint64>(bits.readBits(9)) - 255;
+            else if (!bits.readBit())
+                dod = static_cast<qint64>(bits.readBits(12)) - 2047;
+            else if (!bits.readBit())
+                dod = static_cast<qint64>(bits.readBits(32)) - 2147483647LL;
+            else
+                dod = static_cast<qint64>(bits.readBits(64));
+
+            prev_delta += dod;
+            prev_time += prev_delta;
+        }
+        items[i].time_msecs = prev_time;
+    }
+}
+// <----
+
+// ----> Values: XOR with previous value
+quint64 doubleToBits(double value) { quint64 bits; memcpy(&bits, &value, sizeof(bits)); return bits; }
+double bitsToDouble(quint64 bits) { double value; memcpy(&value, &bits, sizeof(value)); return value; }
+
+bool isXorCompatible(const QVector<QVariant>& values)
+{
+    const int type = values.front().userType();
+    switch (type) {
+    case QMetaType::Bool:
+    case QMetaType::Int:
+    case QMetaType::UInt:
+    case QMetaType::LongLong:
+    case QMetaType::ULongLong:
+    case QMetaType::Float:
+    case QMetaType::Double:
+        break;
+    default:
+        return false;
+    }
+
+    QVariant back;
+    for (const QVariant& value: values)
+    {
+        if (value.userType() != type)
+            return false;
+        if (type == QMetaType::Double)
+            continue;
+
+        back = value.toDouble();
+        if (!back.convert(type) || back != value)
+            return false;
+    }
+    return true;
+}
+
+QByteArray encodeValues(const QVector<QVariant>& values)
+{
+    QByteArray data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_5_7);
+
+    if (!isXorCompatible(values))
+    {
+        ds << static_cast<quint8>(ctVariant);
+        for (const QVariant& value: values)
+            ds << value;
+        return data;
+    }
+
+    BitWriter bits;
+    quint64 prev = doubleToBits(values.front().toDouble()), cur, x;
+    int prev_lead = -1, prev_trail = 0, lead, trail, meaningful;
+    bits.writeBits(prev, 64);
+
+    for (int i = 1; i < values.size(); ++i)
+    {
+        cur = doubleToBits(values.at(i).toDouble());
+        x = cur ^ prev;
+        prev = cur;
+
+        if (x == 0)
+        {
+            bits.writeBit(0);
+            continue;
+        }
+        bits.writeBit(1);
+
+        lead = std::min<int>(qCountLeadingZeroBits(x), 31);
+        trail = qCountTrailingZeroBits(x);
+
+        if (prev_lead >= 0 && lead >= prev_lead && trail >= prev_trail)
+        {
+            bits.writeBit(0);
+            bits.writeBits(x >> prev_trail, 64 - prev_lead - prev_trail);
+        }
+        else
+        {
+            meaningful = 64 - lead - trail;
+            bits.writeBit(1);
+            bits.writeBits(lead, 5);
+            bits.writeBits(meaningful - 1, 6);
+            bits.writeBits(x >> trail, meaningful);
+
+            prev_lead = lead;
+            prev_trail = trail;
+        }
+    }
+
+    ds << static_cast<quint8>(ctXorDouble) << static_cast<qint32>(values.front().userType()) << bits.data();
+    return data;
+}
+
+QVector<QVariant> decodeValues(const QByteArray& data, int count)
+{
+    QVector<QVariant> values;
+    values.reserve(count);
+
+    QDataStream ds(data);
+    ds.setVersion(QDataStream::Qt_5_7);
+
+    quint8 column_type;
+    ds >> column_type;
+
+    if (column_type == ctVariant)
+    {
+        QVariant value;
+        while (values.size() < count && !ds.atEnd())
+        {
+            ds >> value;
+            values.push_back(value);
+        }
+        return values;
+    }
+
+    qint32 type;
+    QByteArray bit_data;
+    ds >> type >> bit_data;
+
+    BitReader bits(bit_data);
+    quint64 prev = bits.readBits(64);
+    int prev_lead = 0, prev_trail = 0, meaningful;
+
+    auto push = [&values, type](quint64 raw) {
+        QVariant value = bitsToDouble(raw);
+        if (type != QMetaType::Double)
+            value.convert(type);
+        values.push_back(value);
+    };
+    push(prev);
+
+    while (values.size() < count)
+    {
+        if (bits.readBit())
+        {
+            if (bits.readBit())
+            {
+                prev_lead = bits.readBits(5);
+                meaningful = bits.readBits(6) + 1;
+                prev_trail = 64 - prev_lead - meaningful;
+            }
+            else
+                meaningful = 64 - prev_lead - prev_trail;
+
+            prev ^= bits.readBits(meaningful) << prev_trail;
+        }
+        push(prev);
+    }
+    return values;
+}
+// <----
+
+} // namespace
+
+LogArchive::LogArchive(const QString &path) :
+    path_(path)
+{
+}
+
+bool LogArchive::open()
+{
+    QDir dir(path_);
+    if (!dir.exists() && !dir.mkpath("."))
+    {
+        qWarning() << "LogArchive: can't create directory" << path_;
+        return false;
+    }
+
+    QVector<File> files;
+    for (const QString& file_name: dir.entryList({"*.dla"}, QDir::Files, QDir::Name))
+    {
+        File file;
+        if (loadFile(dir.absoluteFilePath(file_name), &file))
+            files.push_back(std::move(file));
+        else
+            qWarning() << "LogArchive: bad file" << file_name;
+    }
+
+    std::sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.from_ms < b.from_ms; });
+
+    QMutexLocker lock(&mutex_);
+    files_ = std::move(files);
+    return true;
+}
+
+qint64 LogArchive::endTime() const
+{
+    QMutexLocker lock(&mutex_);
+    return files_.isEmpty() ? 0 : files_.back().to_ms;
+}
+
+quint32 LogArchive::maxId() const
+{
+    QMutexLocker lock(&mutex_);
+    quint32 max_id = 0;
+    for (const File& file: files_)
+        max_id = std::max(max_id, file.max_id);
+    return max_id;
+}
+
+bool LogArchive::write(qint64 from_ms, qint64 to_ms, const QVector<ValuePackItem> &sorted_by_item)
+{
+    Writer writer(this, from_ms, to_ms);
+    for (const ValuePackItem& item: sorted_by_item)
+        if (!writer.add(item))
+            return false;
+    return writer.commit();
+}
+
+QPair<quint32, quint32> LogArchive::range(qint64 date_ms, quint32 max_count) const
+{
+    QMutexLocker lock(&mutex_);
+
+    for (const File& file: files_)
+    {
+        if (file.to_ms <= date_ms)
+            continue;
+
+        // Блок, начавшийся после date_ms, даёт первый id без распаковки.
+        // Распаковываются только блоки, в которых date_ms попадает внутрь, и только если они могут дать id меньше найденного.
+        quint32 start = 0;
+        readBlocks(file, [date_ms, &start](const Block& block) {
+            if (block.last_time <= date_ms || (start && block.first_id >= start))
+                return false;
+            if (block.first_time > date_ms)
+            {
+                start = block.first_id;
+                return false;
+            }
+            return true;
+        }, [date_ms, &start](const ValuePackItem& item) {
+            if (item.time_msecs > date_ms && (!start || item.id < start))
+                start = item.id;
+        });
+
+        if (!start || max_count == 0)
+            continue;
+
+        // Отсутствующие id в диапазоне уйдут на сервер в not_found
+        const quint32 end = std::min<quint64>(file.max_id, static_cast<quint64>(start) + max_count - 1);
+        return {start, end};
+    }
+    return {0, 0};
+}
+
+QVector<ValuePackItem> LogArchive::read(const QPair<quint32, quint32> &range) const
+{
+    QVector<ValuePackItem> items;
+
+    QMutexLocker lock(&mutex_);
+    for (const File& file: files_)
+    {
+        if (file.max_id < range.first || file.min_id > range.second)
+            continue;
+
+        readBlocks(file, [&range](const Block& block) {
+            return block.last_id >= range.first && block.first_id <= range.second;
+        }, [&items, &range](const ValuePackItem& item) {
+            if (item.id >= range.first && item.id <= range.second)
+                items.push_back(item);
+        });
+    }
+
+    std::sort(items.begin(), items.end(), [](const ValuePackItem& a, const ValuePackItem& b) { return a.id < b.id; });
+    return items;
+}
+
+QVector<ValuePackItem> LogArchive::readItem(quint32 item_id, qint64 from_ms, qint64 to_ms) const
+{
+    QVector<ValuePackItem> items;
+
+    QMutexLocker lock(&mutex_);
+    for (const File& file: files_)
+    {
+        if (file.to_ms <= from_ms || file.from_ms > to_ms)
+            continue;
+
+        readBlocks(file, [=](const Block& block) {
+            return block.item_id == item_id && block.last_time >= from_ms && block.first_time <= to_ms;
+        }, [&items, from_ms, to_ms](const ValuePackItem& item) {
+            if (item.time_msecs >= from_ms && item.time_msecs <= to_ms)
+                items.push_back(item);
+        });
+    }
+    return items;
+}
+
+void LogArchive::addFile(LogArchive::File &&file)
+{
+    QMutexLocker lock(&mutex_);
+    const qint64 from_ms = file.from_ms;
+    auto pos = std::upper_bound(files_.begin(), files_.end(), from_ms, [](qint64 from, const File& f) { return from < f.from_ms; });
+    files_.insert(pos, std::move(file));
+}
+
+/*static*/ QByteArray LogArchive::encodeBlock(const ValuePackItem *begin, const ValuePackItem *end)
+{
+    QByteArray ids;
+    QVector<QVariant> raw_values, values;
+    raw_values.reserve(end - begin);
+    values.reserve(end - begin);
+
+    quint32 prev_id = begin->id;
+    for (const ValuePackItem* it = begin; it < end; ++it)
+    {
+        if (it != begin)
+            writeVarint(ids, zigzagEncode(static_cast<qint64>(it->id) - prev_id));
+        prev_id = it->id;
+
+        raw_values.push_back(it->raw_value);
+        values.push_back(it->value);
+    }
+
+    BitWriter times;
+    encodeTimes(times, begin, end);
+
+    QByteArray data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_5_7);
+    ds << ids << times.data() << encodeValues(raw_values) << encodeValues(values);
+    return data;
+}
+
+/*static*/ QVector<ValuePackItem> LogArchive::decodeBlock(quint32 item_id, quint32 count, quint32 first_id, qint64 first_time, const QByteArray &data)
+{
+    QByteArray ids, times, raw_column, value_column;
+    {
+        QDataStream ds(data);
+        ds.setVersion(QDataStream::Qt_5_7);
+        ds >> ids >> times >> raw_column >> value_column;
+        if (ds.status() != QDataStream::Ok)
+            return {};
+    }
+
+    QVector<ValuePackItem> items(count);
+
+    quint64 delta;
+    int pos = 0;
+    quint32 id = first_id;
+    for (ValuePackItem& item: items)
+    {
+        if (&item != items.data())
+        {
+            if (!readVarint(ids, pos, delta))
+                return {};
+            id += zigzagDecode(delta);
+        }
+        item.id = id;
+        item.item_id = item_id;
+    }
+
+    BitReader time_bits(times);
+    decodeTimes(time_bits, items, first_time);
+
+    QVector<QVariant> raw_values = decodeValues(raw_column, count);
+    QVector<QVariant> values = decodeValues(value_column, count);
+    if (raw_values.size() != items.size() || values.size() != items.size())
+        return {};
+
+    for (int i = 0; i < items.size(); ++i)
+    {
+        items[i].raw_value = raw_values.at(i);
+        items[i].value = values.at(i);
+    }
+    return items;
+}
+
+bool LogArchive::loadFile(const QString &file_name, LogArchive::File *file) const
+{
+    QFile in(file_name);
+    if (!in.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream ds(&in);
+    ds.setVersion(QDataStream::Qt_5_7);
+
+    quint32 magic, version, block_count;
+    ds >> magic >> version >> file->from_ms >> file->to_ms >> block_count;
+    if (ds.status() != QDataStream::Ok || magic != archive_magic || version != archive_version)
+        return false;
+
+    file->name = file_name;
+    file->min_id = 0;
+    file->max_id = 0;
+    file->blocks.reserve(block_count);
+
+    Block block;
+    for (quint32 i = 0; i < block_count; ++i)
+    {
+        ds >> block.item_id >> block.count >> block.first_id >> block.last_id
+           >> block.first_time >> block.last_time >> block.size;
+        block.offset = in.pos();
+        if (ds.status() != QDataStream::Ok || !in.seek(block.offset + block.size))
+            return false;
+
+        if (!file->min_id || file->min_id > block.first_id)
+            file->min_id = block.first_id;
+        file->max_id = std::max(file->max_id, block.last_id);
+        file->blocks.push_back(block);
+    }
+    return true;
+}
+
+void LogArchive::readBlocks(const LogArchive::File &file, const std::function<bool (const Block &)> &filter,
+                            const std::function<void (const ValuePackItem &)> &callback) const
+{
+    QFile in(file.name);
+    if (!in.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "LogArchive: can't read" << file.name << in.errorString();
+        return;
+    }
+
+    for (const Block& block: file.blocks)
+    {
+        if (!filter(block) || !in.seek(block.offset))
+            continue;
+
+        for (const ValuePackItem& item: decodeBlock(block.item_id, block.count, block.first_id, block.first_time, in.read(block.size)))
+            callback(item);
+    }
+}
+
+// ----> Writer
+LogArchive::Writer::Writer(LogArchive *archive, qint64 from_ms, qint64 to_ms) :
+    archive_(archive),
+    count_pos_(0),
+    ok_(true)
+{
+    file_.name = QDir(archive->path_).absoluteFilePath(QString("values_%1.dla").arg(from_ms, 14, 10, QChar('0')));
+    file_.from_ms = from_ms;
+    file_.to_ms = to_ms;
+    file_.min_id = 0;
+    file_.max_id = 0;
+
+    out_.setFileName(file_.name);
+    if (!out_.open(QIODevice::WriteOnly))
+    {
+        qWarning() << "LogArchive: can't write" << file_.name << out_.errorString();
+        ok_ = false;
+        return;
+    }
+
+    ds_.setDevice(&out_);
+    ds_.setVersion(QDataStream::Qt_5_7);
+    ds_ << archive_magic << archive_version << from_ms << to_ms;
+    count_pos_ = out_.pos();
+    ds_ << static_cast<quint32>(0); // количество блоков, записывается в commit()
+
+    block_.reserve(max_block_count);
+}
+
+bool LogArchive::Writer::add(const ValuePackItem &item)
+{
+    if (!ok_)
+        return false;
+
+    if (!block_.isEmpty() && (block_.front().item_id != item.item_id || block_.size() >= max_block_count))
+        ok_ = writeBlock();
+
+    block_.push_back(item);
+    return ok_;
+}
+
+bool LogArchive::Writer::commit()
+{
+    if (ok_ && !block_.isEmpty())
+        ok_ = writeBlock();
+    if (!ok_)
+        return false;
+
+    if (!out_.seek(count_pos_))
+        ok_ = false;
+    else
+        ds_ << static_cast<quint32>(file_.blocks.size());
+
+    if (!ok_ || ds_.status() != QDataStream::Ok || !out_.commit())
+    {
+        qWarning() << "LogArchive: write failed" << file_.name << out_.errorString();
+        ok_ = false;
+        return false;
+    }
+
+    archive_->addFile(std::move(file_));
+    ok_ = false;
+    return true;
+}
+
+bool LogArchive::Writer::writeBlock()
+{
+    const ValuePackItem* begin = block_.constData();
+    const ValuePackItem* end = begin + block_.size();
+    const QByteArray data = encodeBlock(begin, end);
+
+    Block block;
+    block.item_id = begin->item_id;
+    block.count = block_.size();
+    block.first_id = begin->id;
+    block.last_id = (end - 1)->id;
+    block.first_time = begin->time_msecs;
+    block.last_time = begin->time_msecs;
+    for (const ValuePackItem* p = begin; p < end; ++p)
+        block.last_time = std::max(block.last_time, p->time_msecs);
+    block.size = data.size();
+
+    ds_ << block.item_id << block.count << block.first_id << block.last_id
+        << block.first_time << block.last_time << block.size;
+    block.offset = out_.pos();
+    ds_.writeRawData(data.constData(), data.size());
+
+    if (!file_.min_id || file_.min_id > block.first_id)
+        file_.min_id = block.first_id;
+    file_.max_id = std::max(file_.max_id, block.last_id);
+    file_.blocks.push_back(block);
+
+    block_.clear();
+    return ds_.status() == QDataStream::Ok;
+}
+// <----
+
+} // namespace Dai
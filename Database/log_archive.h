@@ -0,0 +1,96 @@
+#ifndef DAI_LOG_ARCHIVE_H
+#define DAI_LOG_ARCHIVE_H
+
+#include <functional>
+
+#include <QDataStream>
+#include <QMutex>
+#include <QSaveFile>
+#include <QVector>
+
+#include <Dai/logpack.h>
+
+namespace Dai {
+
+/**
+ * Архив старого журнала значений.
+ * Закрытый промежуток времени хранится в одном файле в виде сжатых блоков по каждому элементу:
+ * id - дельты, время - дельта от дельты, значения - XOR предыдущего (как в Gorilla).
+ */
+class LogArchive
+{
+public:
+    explicit LogArchive(const QString& path);
+
+    class Writer;
+
+    bool open();
+
+    qint64 endTime() const;
+    quint32 maxId() const;
+
+    bool write(qint64 from_ms, qint64 to_ms, const QVector<ValuePackItem>& sorted_by_item);
+
+    QPair<quint32, quint32> range(qint64 date_ms, quint32 max_count = 10000) const;
+    QVector<ValuePackItem> read(const QPair<quint32, quint32>& range) const;
+    QVector<ValuePackItem> readItem(quint32 item_id, qint64 from_ms, qint64 to_ms) const;
+
+    static QByteArray encodeBlock(const ValuePackItem* begin, const ValuePackItem* end);
+    static QVector<ValuePackItem> decodeBlock(quint32 item_id, quint32 count, quint32 first_id, qint64 first_time, const QByteArray& data);
+private:
+    struct Block {
+        quint32 item_id;
+        quint32 count;
+        quint32 first_id;
+        quint32 last_id;
+        qint64 first_time;
+        qint64 last_time;
+        qint64 offset;
+        quint32 size;
+    };
+
+    struct File {
+        QString name;
+        qint64 from_ms;
+        qint64 to_ms;
+        quint32 min_id;
+        quint32 max_id;
+        QVector<Block> blocks;
+    };
+
+    bool loadFile(const QString& file_name, File* file) const;
+    void addFile(File&& file);
+    void readBlocks(const File& file, const std::function<bool(const Block&)>& filter,
+                    const std::function<void(const ValuePackItem&)>& callback) const;
+
+    QString path_;
+    mutable QMutex mutex_;
+    QVector<File> files_;
+};
+
+/**
+ * Запись файла архива по частям: значения подаются по одному в порядке item_id, id,
+ * в памяти держится только текущий блок. Без commit() файл не сохраняется.
+ */
+class LogArchive::Writer
+{
+public:
+    Writer(LogArchive* archive, qint64 from_ms, qint64 to_ms);
+
+    bool add(const ValuePackItem& item);
+    bool commit();
+private:
+    bool writeBlock();
+
+    LogArchive* archive_;
+    File file_;
+    QSaveFile out_;
+    QDataStream ds_;
+    qint64 count_pos_;
+    QVector<ValuePackItem> block_;
+    bool ok_;
+};
+
+} // namespace Dai
+
+#endif // DAI_LOG_ARCHIVE_H
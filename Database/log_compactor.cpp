@@ -0,0 +1,127 @@
+#include <QDebug>
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include "worker.h"
+#include "log_archive.h"
+#include "log_compactor.h"
+
+namespace Dai {
+
+// Дней за один проход, чтобы поток не занимал базу надолго
+#define COMPACT_DAYS_PER_RUN    7
+
+LogCompactor::LogCompactor(Worker *worker, int keep_days, int check_interval_min) :
+    QObject(),
+    db_(new Database(worker->database_info(), "LogCompactor_" + QString::number((quintptr)this))),
+    archive_(worker->log_archive()),
+    keep_days_(std::max(keep_days, 1))
+{
+    connect(&timer_, &QTimer::timeout, this, &LogCompactor::compact);
+    timer_.setTimerType(Qt::VeryCoarseTimer);
+    timer_.start(std::max(check_interval_min, 1) * 60 * 1000);
+
+    QTimer::singleShot(60 * 1000, this, SLOT(compact()));
+}
+
+LogCompactor::~LogCompactor()
+{
+    timer_.stop();
+}
+
+void LogCompactor::compact()
+{
+    if (!archive_)
+        return;
+
+    const QDateTime boundary(QDate::currentDate().addDays(-keep_days_));
+    const quint32 synced_id = syncedId();
+
+    for (int i = 0; i < COMPACT_DAYS_PER_RUN; ++i)
+    {
+        QSqlQuery q(db_->db());
+        if (!q.exec("SELECT MIN(date) FROM house_logs") || !q.next())
+            break;
+
+        QDateTime min_date = q.value(0).toDateTime();
+        if (!min_date.isValid() || min_date >= boundary)
+            break;
+
+        QDateTime from(min_date.date());
+        QDateTime to = std::min(from.addDays(1), boundary);
+        if (!compactRange(from, to, synced_id))
+            break;
+    }
+}
+
+quint32 LogCompactor::syncedId()
+{
+    // Наименьший подтверждённый id среди всех серверов. Пока курсоров нет, переносить нечего
+    QSqlQuery q(db_->db());
+    q.prepare("SELECT MIN(last_id) FROM house_sync_cursor WHERE log_type = ?");
+    q.addBindValue(ValueLog);
+    if (!q.exec() || !q.next())
+    {
+        qWarning() << "LogCompactor: can't read sync cursor" << q.lastError().text();
+        return 0;
+    }
+    return q.value(0).toUInt();
+}
+
+bool LogCompactor::compactRange(const QDateTime &from, const QDateTime &to, quint32 synced_id)
+{
+    QSqlQuery q(db_->db());
+    q.setForwardOnly(true);
+
+    // День переносится целиком и только если сервер подтвердил все его записи
+    q.prepare("SELECT MAX(id) FROM house_logs WHERE date >= ? AND date < ?");
+    q.addBindValue(from);
+    q.addBindValue(to);
+    if (!q.exec() || !q.next())
+    {
+        qWarning() << "LogCompactor: select failed" << q.lastError().text();
+        return false;
+    }
+    if (q.value(0).toUInt() > synced_id)
+        return false;
+
+    q.prepare("SELECT id, item_id, date, raw_value, value FROM house_logs WHERE date >= ? AND date < ? ORDER BY item_id, id");
+    q.addBindValue(from);
+    q.addBindValue(to);
+    if (!q.exec())
+    {
+        qWarning() << "LogCompactor: select failed" << q.lastError().text();
+        return false;
+    }
+
+    // Строки идут по item_id, в архив пишутся блоками по мере чтения
+    LogArchive::Writer writer(archive_.get(), from.toMSecsSinceEpoch(), to.toMSecsSinceEpoch());
+    quint32 max_id = 0, count = 0;
+    while (q.next())
+    {
+        ValuePackItem item{ q.value(0).toUInt(), q.value(1).toUInt(),
+                            q.value(2).toDateTime().toMSecsSinceEpoch(), q.value(3), q.value(4)};
+        max_id = std::max(max_id, item.id);
+        ++count;
+
+        if (!writer.add(item))
+            return false;
+    }
+    q.finish();
+
+    if (count && !writer.commit())
+        return false;
+
+    q.prepare("DELETE FROM house_logs WHERE date >= ? AND date < ? AND id <= ?");
+    q.addBindValue(from);
+    q.addBindValue(to);
+    q.addBindValue(max_id);
+    if (!q.exec())
+    {
+        qWarning() << "LogCompactor: delete failed" << q.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+} // namespace Dai
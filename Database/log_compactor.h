@@ -0,0 +1,41 @@
+#ifndef DAI_LOG_COMPACTOR_H
+#define DAI_LOG_COMPACTOR_H
+
+#include <memory>
+
+#include <QObject>
+#include <QTimer>
+#include <QDateTime>
+
+namespace Dai {
+
+class Worker;
+class Database;
+class LogArchive;
+
+/**
+ * Переносит закрытые дни журнала значений из house_logs в архив.
+ * Переносятся только дни, все записи которых подтверждены курсорами синхронизации.
+ * Работает в своём потоке со своим подключением к базе.
+ */
+class LogCompactor : public QObject
+{
+    Q_OBJECT
+public:
+    LogCompactor(Worker* worker, int keep_days = 30, int check_interval_min = 60);
+    ~LogCompactor();
+private slots:
+    void compact();
+private:
+    quint32 syncedId();
+    bool compactRange(const QDateTime& from, const QDateTime& to, quint32 synced_id);
+
+    std::unique_ptr<Database> db_;
+    std::shared_ptr<LogArchive> archive_;
+    int keep_days_;
+    QTimer timer_;
+};
+
+} // namespace Dai
+
+#endif // DAI_LOG_COMPACTOR_H
@@ -0,0 +1,235 @@
+#include <algorithm>
+
+#include <QDebug>
+#include <QDateTime>
+#include <QSqlQuery>
+#include <QSqlError>
+
+#include "log_rollup.h"
+
+namespace Dai {
+
+#define ROLLUP_FLUSH_INTERVAL   60 * 1000
+
+void LogRollup::Point::add(double value)
+{
+    if (count == 0)
+        min = max = value;
+    else
+    {
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+    sum += value;
+    last = value;
+    ++count;
+}
+
+void LogRollup::Point::merge(const Point &other)
+{
+    if (!other.count)
+        return;
+
+    if (count == 0)
+    {
+        min = other.min;
+        max = other.max;
+    }
+    else
+    {
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+    sum += other.sum;
+    count += other.count;
+    last = other.last;
+}
+
+LogRollup::LogRollup(const QSqlDatabase &db) :
+    db_(db)
+{
+}
+
+LogRollup::~LogRollup()
+{
+    flush(true);
+}
+
+bool LogRollup::createTable()
+{
+    QSqlQuery q(db_);
+    if (!q.exec("CREATE TABLE IF NOT EXISTS house_logs_rollup ("
+                "resolution TINYINT UNSIGNED NOT NULL, "
+                "item_id INT UNSIGNED NOT NULL, "
+                "time_start BIGINT NOT NULL, "
+                "min_value DOUBLE NOT NULL, "
+                "max_value DOUBLE NOT NULL, "
+                "sum_value DOUBLE NOT NULL, "
+                "count INT UNSIGNED NOT NULL, "
+                "last_value DOUBLE NOT NULL, "
+                "PRIMARY KEY (resolution, item_id, time_start))"))
+    {
+        qWarning() << "LogRollup: can't create table" << q.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+void LogRollup::add(quint32 item_id, qint64 time_ms, double value)
+{
+    for (int r = rMinute; r < rCount; ++r)
+    {
+        const qint64 start = bucketStart(static_cast<Resolution>(r), time_ms);
+
+        auto it = open_[r].find(item_id);
+        if (it == open_[r].end())
+            it = open_[r].emplace(item_id, Point{item_id, start, 0., 0., 0., 0, 0.}).first;
+        else if (it->second.time_ms != start)
+        {
+            closed_[r].push_back(it->second);
+            it->second = Point{item_id, start, 0., 0., 0., 0, 0.};
+        }
+        it->second.add(value);
+    }
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (now - last_flush_ms_ >= ROLLUP_FLUSH_INTERVAL)
+    {
+        last_flush_ms_ = now;
+        flush();
+    }
+}
+
+bool LogRollup::flush(bool with_open)
+{
+    if (with_open)
+        for (int r = rMinute; r < rCount; ++r)
+        {
+            for (auto& it: open_[r])
+                closed_[r].push_back(it.second);
+            open_[r].clear();
+        }
+
+    QSqlQuery q(db_);
+    q.prepare("INSERT INTO house_logs_rollup "
+              "(resolution, item_id, time_start, min_value, max_value, sum_value, count, last_value) "
+              "VALUES (?, ?, ?, ?, ?, ?, ?, ?) ON DUPLICATE KEY UPDATE "
+              "min_value = LEAST(min_value, VALUES(min_value)), "
+              "max_value = GREATEST(max_value, VALUES(max_value)), "
+              "sum_value = sum_value + VALUES(sum_value), "
+              "count = count + VALUES(count), "
+              "last_value = VALUES(last_value)");
+
+    bool transaction = db_.transaction();
+    for (int r = rMinute; r < rCount; ++r)
+    {
+        for (const Point& point: closed_[r])
+        {
+            q.addBindValue(r);
+            q.addBindValue(point.item_id);
+            q.addBindValue(point.time_ms);
+            q.addBindValue(point.min);
+            q.addBindValue(point.max);
+            q.addBindValue(point.sum);
+            q.addBindValue(point.count);
+            q.addBindValue(point.last);
+            if (!q.exec())
+            {
+                qWarning() << "LogRollup: can't save" << q.lastError().text();
+                if (transaction)
+                    db_.rollback();
+                return false;
+            }
+        }
+    }
+
+    if (transaction && !db_.commit())
+    {
+        qWarning() << "LogRollup: commit failed" << db_.lastError().text();
+        return false;
+    }
+
+    for (int r = rMinute; r < rCount; ++r)
+        closed_[r].clear();
+    return true;
+}
+
+QVector<LogRollup::Point> LogRollup::query(quint32 item_id, qint64 from_ms, qint64 to_ms, qint64 step_ms)
+{
+    const Resolution resolution = resolutionFor(step_ms);
+    from_ms = bucketStart(resolution, from_ms);
+
+    std::map<qint64, Point> points;
+
+    QSqlQuery q(db_);
+    q.setForwardOnly(true);
+    q.prepare("SELECT time_start, min_value, max_value, sum_value, count, last_value FROM house_logs_rollup "
+              "WHERE resolution = ? AND item_id = ? AND time_start >= ? AND time_start <= ? ORDER BY time_start");
+    q.addBindValue(static_cast<int>(resolution));
+    q.addBindValue(item_id);
+    q.addBindValue(from_ms);
+    q.addBindValue(to_ms);
+    if (q.exec())
+    {
+        while (q.next())
+        {
+            Point point{item_id, q.value(0).toLongLong(), q.value(1).toDouble(), q.value(2).toDouble(),
+                        q.value(3).toDouble(), q.value(4).toUInt(), q.value(5).toDouble()};
+            points.emplace(point.time_ms, point);
+        }
+    }
+    else
+        qWarning() << "LogRollup: query failed" << q.lastError().text();
+
+    // Ещё не сохранённые интервалы
+    auto merge = [&](const Point& point) {
+        if (point.item_id != item_id || point.time_ms < from_ms || point.time_ms > to_ms)
+            return;
+
+        auto it = points.find(point.time_ms);
+        if (it == points.end())
+            points.emplace(point.time_ms, point);
+        else
+            it->second.merge(point);
+    };
+
+    for (const Point& point: closed_[resolution])
+        merge(point);
+
+    auto open_it = open_[resolution].find(item_id);
+    if (open_it != open_[resolution].cend())
+        merge(open_it->second);
+
+    QVector<Point> result;
+    result.reserve(points.size());
+    for (const auto& it: points)
+        result.push_back(it.second);
+    return result;
+}
+
+/*static*/ LogRollup::Resolution LogRollup::resolutionFor(qint64 step_ms)
+{
+    if (step_ms >= 24 * 60 * 60 * 1000LL)
+        return rDay;
+    if (step_ms >= 60 * 60 * 1000LL)
+        return rHour;
+    return rMinute;
+}
+
+/*static*/ qint64 LogRollup::bucketStart(Resolution resolution, qint64 time_ms)
+{
+    switch (resolution) {
+    case rMinute:   return time_ms - (time_ms % (60 * 1000LL));
+    case rHour:     return time_ms - (time_ms % (60 * 60 * 1000LL));
+    case rDay:
+    default:
+    {
+        // Дни по местному времени, чтобы графики показывали календарные сутки
+        const qint64 offset = QDateTime::fromMSecsSinceEpoch(time_ms).offsetFromUtc() * 1000LL;
+        const qint64 day = 24 * 60 * 60 * 1000LL;
+        return ((time_ms + offset) / day) * day - offset;
+    }
+    }
+}
+
+} // namespace Dai
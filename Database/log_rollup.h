@@ -0,0 +1,63 @@
+#ifndef DAI_LOG_ROLLUP_H
+#define DAI_LOG_ROLLUP_H
+
+#include <map>
+#include <vector>
+
+#include <QVector>
+#include <QSqlDatabase>
+
+namespace Dai {
+
+/**
+ * Агрегаты журнала значений (min/max/avg/count/last) по минутам, часам и дням.
+ * Считаются по мере поступления значений, закрытые интервалы пишутся в house_logs_rollup.
+ */
+class LogRollup
+{
+public:
+    enum Resolution : quint8 {
+        rMinute = 0,
+        rHour,
+        rDay,
+
+        rCount
+    };
+
+    struct Point {
+        quint32 item_id;
+        qint64 time_ms;
+        double min;
+        double max;
+        double sum;
+        quint32 count;
+        double last;
+
+        double avg() const { return count ? sum / count : 0.; }
+        void add(double value);
+        void merge(const Point& other);
+    };
+
+    explicit LogRollup(const QSqlDatabase& db);
+    ~LogRollup();
+
+    bool createTable();
+
+    void add(quint32 item_id, qint64 time_ms, double value);
+    bool flush(bool with_open = false);
+
+    QVector<Point> query(quint32 item_id, qint64 from_ms, qint64 to_ms, qint64 step_ms);
+
+    static Resolution resolutionFor(qint64 step_ms);
+    static qint64 bucketStart(Resolution resolution, qint64 time_ms);
+private:
+    QSqlDatabase db_;
+    qint64 last_flush_ms_ = 0;
+
+    std::map<quint32, Point> open_[rCount];
+    std::vector<Point> closed_[rCount];
+};
+
+} // namespace Dai
+
+#endif // DAI_LOG_ROLLUP_H
@@ -0,0 +1,420 @@
+#include <algorithm>
+#include <cstring>
+
+#include <QDir>
+#include <QFileInfo>
+#include <QDebug>
+#include <QDataStream>
+#include <QtEndian>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "log_value_store.h"
+
+namespace Dai {
+
+namespace {
+
+const char segment_magic[4] = { 'D', 'L', 'S', '1' };
+const qint64 segment_header_size = 16;
+
+// payload size, id, item_id, time
+const qint64 record_header_size = 4 + 4 + 4 + 8;
+
+// Каждая N-я запись попадает в разреженный индекс
+const quint32 index_step = 64;
+
+// Запись на диск не чаще, чем раз в N записей или раз в секунду
+const quint32 sync_records = 256;
+const qint64 sync_interval_ms = 1000;
+
+struct RecordHeader {
+    quint32 size;
+    quint32 id;
+    quint32 item_id;
+    qint64 time_ms;
+};
+
+RecordHeader readRecordHeader(const uchar* p)
+{
+    return { qFromLittleEndian<quint32>(p), qFromLittleEndian<quint32>(p + 4),
+             qFromLittleEndian<quint32>(p + 8), qFromLittleEndian<qint64>(p + 12) };
+}
+
+} // namespace
+
+LogValueStore::LogValueStore(const QString &path, qint64 segment_size, int max_segments, int max_mapped) :
+    path_(path),
+    segment_size_(std::max<qint64>(segment_size, 64 * 1024)),
+    max_segments_(std::max(max_segments, 2)),
+    max_mapped_(std::max(max_mapped, 2))
+{
+    sync_timer_.start();
+}
+
+LogValueStore::~LogValueStore()
+{
+    for (auto& sct: segments_)
+        unmap(sct.get());
+}
+
+bool LogValueStore::open(quint32 last_id)
+{
+    QDir dir(path_);
+    if (!dir.exists() && !dir.mkpath("."))
+    {
+        qWarning() << "LogValueStore: can't create directory" << path_;
+        return false;
+    }
+
+    for (const QString& file_name: dir.entryList({"*.dls"}, QDir::Files, QDir::Name))
+    {
+        std::unique_ptr<Segment> sct = openSegment(dir.absoluteFilePath(file_name));
+        if (!sct)
+            return false;
+
+        if (!segments_.empty() && sct->first_id != segments_.back()->last_id + 1)
+            qWarning() << "LogValueStore: gap before segment" << file_name;
+        segments_.push_back(std::move(sct));
+    }
+
+    // Пока хранилище было выключено, журнал писался в базу, id не должны пересекаться
+    if (segments_.empty() || last_id > lastId())
+        return createSegment(std::max(last_id, lastId()) + 1);
+    return true;
+}
+
+bool LogValueStore::isOpen() const { return !segments_.empty(); }
+
+quint32 LogValueStore::firstId() const
+{
+    return segments_.empty() ? 0 : segments_.front()->first_id;
+}
+
+quint32 LogValueStore::lastId() const
+{
+    return segments_.empty() ? 0 : segments_.back()->last_id;
+}
+
+bool LogValueStore::append(quint32 item_id, qint64 time_ms, const QVariant &raw_value, const QVariant &value, quint32 *id_out)
+{
+    if (segments_.empty())
+        return false;
+
+    QByteArray payload;
+    {
+        QDataStream ds(&payload, QIODevice::WriteOnly);
+        ds.setVersion(QDataStream::Qt_5_7);
+        ds << raw_value << value;
+    }
+
+    const qint64 record_size = record_header_size + payload.size();
+    if (segment_header_size + record_size > segment_size_)
+    {
+        qWarning() << "LogValueStore: record is too big" << item_id << record_size;
+        return false;
+    }
+
+    Segment* sct = segments_.back().get();
+    if (sct->used + record_size > sct->size)
+    {
+        if (!createSegment(sct->last_id + 1))
+            return false;
+        sct = segments_.back().get();
+    }
+
+    uchar* p = const_cast<uchar*>(data(sct));
+    if (!p)
+        return false;
+    p += sct->used;
+
+    const quint32 id = sct->last_id + 1;
+
+    // Размер пишется последним: запись без него при чтении считается концом данных
+    memcpy(p + record_header_size, payload.constData(), payload.size());
+    qToLittleEndian<quint32>(id, p + 4);
+    qToLittleEndian<quint32>(item_id, p + 8);
+    qToLittleEndian<qint64>(time_ms, p + 12);
+    qToLittleEndian<quint32>(payload.size(), p);
+
+    addToIndex(sct, id, sct->used, time_ms);
+    sct->used += record_size;
+    sct->last_id = id;
+
+    if (++records_after_sync_ >= sync_records || sync_timer_.elapsed() >= sync_interval_ms)
+        sync();
+
+    if (id_out)
+        *id_out = id;
+    return true;
+}
+
+void LogValueStore::sync()
+{
+    for (auto& sct: segments_)
+        syncSegment(sct.get());
+    records_after_sync_ = 0;
+    sync_timer_.restart();
+}
+
+QPair<quint32, quint32> LogValueStore::range(qint64 date_ms, quint32 max_count) const
+{
+    auto it = std::find_if(index_.cbegin(), index_.cend(), [date_ms](const IndexItem& item) {
+        return item.max_time_ms > date_ms;
+    });
+
+    quint32 start = 0;
+    scan(it, [&](const RecordHeader& hdr, const uchar*) {
+        if (hdr.time_ms > date_ms)
+            start = hdr.id;
+        return start == 0;
+    });
+
+    if (start == 0 || max_count == 0)
+        return {0, 0};
+    quint64 end = std::min<quint64>(lastId(), static_cast<quint64>(start) + max_count - 1);
+    return { start, static_cast<quint32>(end) };
+}
+
+void LogValueStore::read(const QPair<quint32, quint32> &range, const std::function<void (const ValuePackItem &)> &callback) const
+{
+    auto it = std::upper_bound(index_.cbegin(), index_.cend(), range.first, [](quint32 id, const IndexItem& item) {
+        return id < item.id;
+    });
+    if (it != index_.cbegin())
+        --it;
+
+    QVariant raw_value, value;
+    scan(it, [&](const RecordHeader& hdr, const uchar* payload) {
+        if (hdr.id > range.second)
+            return false;
+
+        if (hdr.id >= range.first)
+        {
+            QDataStream ds(QByteArray::fromRawData(reinterpret_cast<const char*>(payload), hdr.size));
+            ds.setVersion(QDataStream::Qt_5_7);
+            ds >> raw_value >> value;
+            callback(ValuePackItem{ hdr.id, hdr.item_id, hdr.time_ms, raw_value, value });
+        }
+        return true;
+    });
+}
+
+std::deque<std::unique_ptr<LogValueStore::Segment>>::const_iterator LogValueStore::segment(quint32 number) const
+{
+    // Номера файлов могут идти с пропусками, например если сегмент удалили вручную
+    return std::lower_bound(segments_.cbegin(), segments_.cend(), number, [](const std::unique_ptr<Segment>& sct, quint32 value) {
+        return sct->number < value;
+    });
+}
+
+const uchar *LogValueStore::data(Segment *sct) const
+{
+    sct->last_use = ++use_counter_;
+    if (sct->data)
+        return sct->data;
+
+    // Освобождаем дольше всех не использованный сегмент, последний нужен для записи
+    while (mapped_count_ >= max_mapped_)
+    {
+        Segment* oldest = nullptr;
+        for (std::size_t i = 0; i + 1 < segments_.size(); ++i)
+        {
+            Segment* it = segments_.at(i).get();
+            if (it->data && (!oldest || it->last_use < oldest->last_use))
+                oldest = it;
+        }
+        if (!oldest)
+            break;
+        unmap(oldest);
+    }
+
+    return map(sct) ? sct->data : nullptr;
+}
+
+bool LogValueStore::map(Segment *sct) const
+{
+    if (!sct->file.isOpen() && !sct->file.open(QIODevice::ReadWrite))
+    {
+        qWarning() << "LogValueStore: can't open" << sct->file.fileName() << sct->file.errorString();
+        return false;
+    }
+
+    sct->data = sct->file.map(0, sct->size);
+    if (!sct->data)
+    {
+        qWarning() << "LogValueStore: can't map" << sct->file.fileName() << sct->file.errorString();
+        sct->file.close();
+        return false;
+    }
+
+    ++mapped_count_;
+    return true;
+}
+
+void LogValueStore::unmap(Segment *sct) const
+{
+    if (!sct->data)
+        return;
+
+    syncSegment(sct);
+    sct->file.unmap(sct->data);
+    sct->file.close();
+    sct->data = nullptr;
+    --mapped_count_;
+}
+
+void LogValueStore::syncSegment(Segment *sct) const
+{
+    if (!sct->data || sct->synced >= sct->used)
+        return;
+
+#ifdef Q_OS_UNIX
+    static const qint64 page_size = sysconf(_SC_PAGESIZE);
+    const qint64 from = sct->synced - sct->synced % page_size;
+    if (msync(sct->data + from, sct->used - from, MS_SYNC) != 0)
+        qWarning() << "LogValueStore: msync failed" << sct->file.fileName();
+#endif
+    sct->synced = sct->used;
+}
+
+std::unique_ptr<LogValueStore::Segment> LogValueStore::openSegment(const QString &file_name)
+{
+    std::unique_ptr<Segment> sct(new Segment);
+    sct->file.setFileName(file_name);
+    if (!sct->file.open(QIODevice::ReadWrite))
+    {
+        qWarning() << "LogValueStore: can't open" << file_name << sct->file.errorString();
+        return {};
+    }
+
+    if (sct->file.size() < segment_size_ && !sct->file.resize(segment_size_))
+    {
+        qWarning() << "LogValueStore: can't allocate" << file_name << sct->file.errorString();
+        return {};
+    }
+
+    sct->size = sct->file.size();
+    if (!data(sct.get()) || memcmp(sct->data, segment_magic, sizeof(segment_magic)) != 0)
+    {
+        qWarning() << "LogValueStore: bad segment" << file_name << sct->file.errorString();
+        unmap(sct.get());
+        return {};
+    }
+
+    sct->number = QFileInfo(file_name).baseName().toUInt();
+    sct->first_id = qFromLittleEndian<quint32>(sct->data + 8);
+    sct->last_id = sct->first_id - 1;
+    sct->used = segment_header_size;
+
+    // Find the end of the written data and fill index
+    while (sct->used + record_header_size <= sct->size)
+    {
+        RecordHeader hdr = readRecordHeader(sct->data + sct->used);
+        if (hdr.size == 0 || hdr.id != sct->last_id + 1 ||
+            sct->used + record_header_size + hdr.size > sct->size)
+            break;
+
+        addToIndex(sct.get(), hdr.id, sct->used, hdr.time_ms);
+        sct->last_id = hdr.id;
+        sct->used += record_header_size + hdr.size;
+    }
+    sct->synced = sct->used;
+
+    // Отображается снова при первом обращении
+    unmap(sct.get());
+    return sct;
+}
+
+bool LogValueStore::createSegment(quint32 first_id)
+{
+    quint32 number = segments_.empty() ? 1 : segments_.back()->number + 1;
+    QString file_name = QDir(path_).absoluteFilePath(QString("%1.dls").arg(number, 8, 10, QChar('0')));
+
+    {
+        QFile file(file_name);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || !file.resize(segment_size_))
+        {
+            qWarning() << "LogValueStore: can't create segment" << file_name << file.errorString();
+            return false;
+        }
+
+        uchar header[segment_header_size] = {0};
+        memcpy(header, segment_magic, sizeof(segment_magic));
+        qToLittleEndian<quint32>(1, header + 4); // version
+        qToLittleEndian<quint32>(first_id, header + 8);
+        file.write(reinterpret_cast<const char*>(header), segment_header_size);
+    }
+
+    std::unique_ptr<Segment> sct = openSegment(file_name);
+    if (!sct)
+        return false;
+
+    if (!segments_.empty())
+        syncSegment(segments_.back().get());
+    segments_.push_back(std::move(sct));
+
+    removeOldSegments();
+    return true;
+}
+
+void LogValueStore::removeOldSegments()
+{
+    while (segments_.size() > static_cast<std::size_t>(max_segments_))
+    {
+        std::unique_ptr<Segment> sct = std::move(segments_.front());
+        segments_.pop_front();
+
+        auto it = std::find_if(index_.begin(), index_.end(), [&sct](const IndexItem& item) {
+            return item.segment_number != sct->number;
+        });
+        index_.erase(index_.begin(), it);
+
+        unmap(sct.get());
+        sct->file.remove();
+    }
+}
+
+void LogValueStore::addToIndex(const Segment *sct, quint32 id, qint64 offset, qint64 time_ms)
+{
+    if (index_.empty() || index_.back().segment_number != sct->number || records_after_index_ >= index_step)
+    {
+        index_.push_back(IndexItem{ id, sct->number, offset, time_ms });
+        records_after_index_ = 1;
+    }
+    else
+    {
+        index_.back().max_time_ms = std::max(index_.back().max_time_ms, time_ms);
+        ++records_after_index_;
+    }
+}
+
+template<typename Func>
+void LogValueStore::scan(std::vector<IndexItem>::const_iterator from, Func func) const
+{
+    if (from == index_.cend())
+        return;
+
+    qint64 offset = from->offset;
+    for (auto it = segment(from->segment_number); it != segments_.cend(); ++it)
+    {
+        Segment* sct = it->get();
+        const uchar* p = data(sct);
+        if (!p)
+            return;
+
+        while (offset < sct->used)
+        {
+            RecordHeader hdr = readRecordHeader(p + offset);
+            if (!func(hdr, p + offset + record_header_size))
+                return;
+            offset += record_header_size + hdr.size;
+        }
+        offset = segment_header_size;
+    }
+}
+
+} // namespace Dai
@@ -0,0 +1,99 @@
+#ifndef DAI_LOG_VALUE_STORE_H
+#define DAI_LOG_VALUE_STORE_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QVariant>
+
+#include <Dai/logpack.h>
+
+namespace Dai {
+
+/**
+ * Хранилище журнала значений без SQL.
+ * Записи только дописываются в файлы-сегменты фиксированного размера,
+ * чтение идёт через отображение сегментов в память.
+ * Одновременно отображено не больше max_mapped сегментов, остальные
+ * отображаются по запросу, так что на 32-битных системах хватает адресов.
+ * Идентификаторы записей идут подряд, поэтому для поиска достаточно
+ * разреженного индекса (id, время) в памяти.
+ */
+class LogValueStore
+{
+public:
+    LogValueStore(const QString& path, qint64 segment_size = 4 * 1024 * 1024, int max_segments = 256, int max_mapped = 4);
+    ~LogValueStore();
+
+    // last_id - последний id журнала в базе, новые записи получат id больше него
+    bool open(quint32 last_id = 0);
+    bool isOpen() const;
+
+    quint32 firstId() const;
+    quint32 lastId() const;
+
+    bool append(quint32 item_id, qint64 time_ms, const QVariant& raw_value, const QVariant& value, quint32* id_out = nullptr);
+
+    // Записывает на диск всё, что ещё не записано
+    void sync();
+
+    QPair<quint32, quint32> range(qint64 date_ms, quint32 max_count = 10000) const;
+    void read(const QPair<quint32, quint32>& range, const std::function<void(const ValuePackItem&)>& callback) const;
+private:
+    struct Segment {
+        QFile file;
+        uchar* data = nullptr;
+        qint64 size = 0;
+        qint64 used = 0;
+        qint64 synced = 0;
+        quint32 number = 0;
+        quint32 first_id = 0;
+        quint32 last_id = 0;
+        quint64 last_use = 0;
+    };
+
+    struct IndexItem {
+        quint32 id;
+        quint32 segment_number;
+        qint64 offset;
+        qint64 max_time_ms;
+    };
+
+    // Первый сегмент с номером не меньше number
+    std::deque<std::unique_ptr<Segment>>::const_iterator segment(quint32 number) const;
+    const uchar* data(Segment* sct) const;
+    bool map(Segment* sct) const;
+    void unmap(Segment* sct) const;
+    void syncSegment(Segment* sct) const;
+
+    std::unique_ptr<Segment> openSegment(const QString& file_name);
+    bool createSegment(quint32 first_id);
+    void removeOldSegments();
+    void addToIndex(const Segment* sct, quint32 id, qint64 offset, qint64 time_ms);
+
+    template<typename Func>
+    void scan(std::vector<IndexItem>::const_iterator from, Func func) const;
+
+    QString path_;
+    qint64 segment_size_;
+    int max_segments_;
+    int max_mapped_;
+
+    std::deque<std::unique_ptr<Segment>> segments_;
+    std::vector<IndexItem> index_;
+    quint32 records_after_index_ = 0;
+
+    mutable int mapped_count_ = 0;
+    mutable quint64 use_counter_ = 0;
+
+    quint32 records_after_sync_ = 0;
+    QElapsedTimer sync_timer_;
+};
+
+} // namespace Dai
+
+#endif // DAI_LOG_VALUE_STORE_H
@@ -0,0 +1,172 @@
+#ifndef DAI_NETWORK_CACHED_CALL_H
+#define DAI_NETWORK_CACHED_CALL_H
+
+#include <map>
+#include <memory>
+
+#include <QDataStream>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSemaphore>
+#include <QTimer>
+
+namespace Dai {
+namespace Network {
+
+/**
+ * Вызов метода объекта из другого потока с кэшем результата.
+ * Подключается к сигналу с Qt::DirectConnection: повторный вызов с теми же
+ * аргументами в течение ttl_ms возвращает сохранённый результат сразу,
+ * и только при промахе поток ждёт, пока объект выполнит метод в своём потоке.
+ * R() для вызывающего - отказ, поэтому ожидание не прерывается: если ответа
+ * нет дольше slow_ms, это только пишется в лог.
+ * Одновременные промахи с одинаковыми аргументами ждут один вызов.
+ * Аргументы должны сериализоваться в QDataStream, они же ключ кэша.
+ */
+template<typename F> class CachedCall;
+
+template<typename R, typename C, typename... Args>
+class CachedCall<R (C::*)(Args...)>
+{
+public:
+    typedef R (C::*Func)(Args...);
+
+    CachedCall(C* obj, Func func, int ttl_ms, int slow_ms, int max_size = 1000) :
+        d(std::make_shared<Data>(obj, func, ttl_ms, slow_ms, max_size)) {}
+
+    R operator()(Args... args) const
+    {
+        const QByteArray key = makeKey(args...);
+        std::shared_ptr<Pending> pending;
+        bool is_new = false;
+        quint64 generation;
+        {
+            QMutexLocker lock(&d->mutex);
+            generation = d->generation;
+            auto it = d->cache.find(key);
+            if (it != d->cache.end())
+            {
+                if (it->second.time.elapsed() < d->ttl_ms)
+                    return it->second.value;
+                d->cache.erase(it);
+            }
+
+            std::shared_ptr<Pending>& waited = d->pending[key];
+            if (!waited)
+            {
+                waited = std::make_shared<Pending>();
+                is_new = true;
+            }
+            pending = waited;
+        }
+
+        if (is_new)
+        {
+            std::shared_ptr<Data> data = d;
+            QTimer::singleShot(0, d->obj, [=]()
+            {
+                pending->value = (data->obj->*data->func)(args...);
+                store(data.get(), key, pending, generation);
+                pending->done.release();
+            });
+        }
+
+        if (!pending->done.tryAcquire(1, d->slow_ms))
+        {
+            qWarning() << "CachedCall: no answer for" << d->slow_ms << "ms, still waiting";
+            pending->done.acquire();
+        }
+        // Следующий ждущий этот же вызов
+        pending->done.release();
+        return pending->value;
+    }
+
+    // Отзыв: следующий вызов с этими аргументами снова идёт к объекту
+    void invalidate(Args... args) const
+    {
+        const QByteArray key = makeKey(args...);
+        QMutexLocker lock(&d->mutex);
+        d->cache.erase(key);
+        d->pending.erase(key);
+        ++d->generation;
+    }
+
+    void clear() const
+    {
+        QMutexLocker lock(&d->mutex);
+        d->cache.clear();
+        d->pending.clear();
+        ++d->generation;
+    }
+private:
+    struct Pending {
+        R value = R();
+        QSemaphore done;
+    };
+
+    struct Item {
+        R value;
+        QElapsedTimer time;
+    };
+
+    struct Data {
+        Data(C* obj, Func func, int ttl_ms, int slow_ms, int max_size) :
+            obj(obj), func(func), ttl_ms(ttl_ms), slow_ms(slow_ms), max_size(max_size) {}
+
+        C* obj;
+        Func func;
+        int ttl_ms, slow_ms, max_size;
+
+        QMutex mutex;
+        std::map<QByteArray, Item> cache;
+        std::map<QByteArray, std::shared_ptr<Pending>> pending;
+        quint64 generation = 0; // ответ, начатый до отзыва, в кэш не попадает
+    };
+
+    static QByteArray makeKey(Args... args)
+    {
+        QByteArray key;
+        QDataStream ds(&key, QIODevice::WriteOnly);
+        ds.setVersion(QDataStream::Qt_5_7);
+        auto expand = { 0, (ds << args, 0)... };
+        Q_UNUSED(expand);
+        return key;
+    }
+
+    static void store(Data* data, const QByteArray& key, const std::shared_ptr<Pending>& pending, quint64 generation)
+    {
+        QMutexLocker lock(&data->mutex);
+        auto it = data->pending.find(key);
+        if (it != data->pending.end() && it->second == pending)
+            data->pending.erase(it);
+
+        const R& value = pending->value;
+        if (generation != data->generation)
+            return;
+        if (data->cache.size() >= static_cast<std::size_t>(data->max_size))
+            removeExpired(data);
+        if (data->cache.size() < static_cast<std::size_t>(data->max_size))
+        {
+            Item& item = data->cache[key];
+            item.value = value;
+            item.time.start();
+        }
+    }
+
+    static void removeExpired(Data* data)
+    {
+        for (auto it = data->cache.begin(); it != data->cache.end(); )
+            if (it->second.time.elapsed() >= data->ttl_ms)
+                it = data->cache.erase(it);
+            else
+                ++it;
+    }
+
+    std::shared_ptr<Data> d;
+};
+
+} // namespace Network
+} // namespace Dai
+
+#endif // DAI_NETWORK_CACHED_CALL_H
@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <cstring>
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+#include "file_receiver.h"
+
+namespace Dai {
+namespace Network {
+
+namespace {
+
+const qint64 min_capacity = 1024 * 1024;
+const int hash_chunk_size = 1024 * 1024;
+// После стольких принятых байт данные пишутся на диск и диапазоны сохраняются,
+// чтобы после падения не принимать файл заново
+const qint64 state_save_bytes = 8 * 1024 * 1024;
+
+bool hashAlgorithm(int hash_size, QCryptographicHash::Algorithm* algorithm)
+{
+    switch (hash_size) {
+    case 16: *algorithm = QCryptographicHash::Md5; return true;
+    case 20: *algorithm = QCryptographicHash::Sha1; return true;
+    case 32: *algorithm = QCryptographicHash::Sha256; return true;
+    case 64: *algorithm = QCryptographicHash::Sha512; return true;
+    default: return false;
+    }
+}
+
+} // namespace
+
+FileReceiver::FileReceiver(const QString &dir) :
+    dir_(dir), file_(QDir(dir).filePath("receive.part")),
+    data_(nullptr), capacity_(0), unsaved_bytes_(0), state_loaded_(false), size_(-1)
+{
+}
+
+FileReceiver::~FileReceiver()
+{
+    suspend();
+}
+
+bool FileReceiver::begin(const QByteArray &hash, const QString &file_name, qint64 size)
+{
+    open();
+
+    if (hash_ != hash || file_name_ != file_name || size_ != size)
+    {
+        if (!ranges_.empty())
+            qWarning() << "FileReceiver: drop parts of another file" << file_name_;
+        clear();
+
+        hash_ = hash;
+        file_name_ = file_name;
+        size_ = size;
+        if (!open())
+            return false;
+        saveState();
+        return false;
+    }
+    return !ranges_.empty();
+}
+
+bool FileReceiver::write(qint64 pos, const QByteArray &data)
+{
+    if (pos < 0 || (size_ >= 0 && pos + data.size() > size_))
+    {
+        qWarning() << "FileReceiver: part is out of file" << pos << data.size() << size_;
+        return false;
+    }
+
+    if (!open() || !reserve(pos + data.size()))
+        return false;
+
+    memcpy(data_ + pos, data.constData(), data.size());
+    addRange(pos, pos + data.size());
+
+    unsaved_bytes_ += data.size();
+    if (unsaved_bytes_ >= state_save_bytes)
+    {
+        // Диапазоны не должны указывать на данные, которых ещё нет на диске
+        sync();
+        saveState();
+    }
+    return true;
+}
+
+bool FileReceiver::hasData() const
+{
+    return !ranges_.empty() || (!state_loaded_ && QFile::exists(file_.fileName() + ".ranges"));
+}
+
+const QByteArray &FileReceiver::hash() const { return hash_; }
+
+QVector<QPair<qint64, qint64>> FileReceiver::ranges()
+{
+    open();
+
+    QVector<QPair<qint64, qint64>> res;
+    for (const auto& range: ranges_)
+        res.push_back(qMakePair(range.first, range.second));
+    return res;
+}
+
+bool FileReceiver::finish(const QByteArray &hash, const QString &file_name, QString *out_path)
+{
+    if (!open())
+        return false;
+
+    if (!hash_.isEmpty() && (hash_ != hash || file_name_ != file_name))
+    {
+        qWarning() << "FileReceiver: parts belong to another file" << file_name_ << "not" << file_name;
+        clear();
+        return false;
+    }
+
+    // Без заголовка размер не известен, полноту подтверждает только хэш
+    if (!isComplete())
+    {
+        qWarning() << "FileReceiver: file isn't complete, ranges:" << ranges_.size() << "size:" << size_;
+        suspend();
+        return false;
+    }
+
+    QCryptographicHash::Algorithm algorithm;
+    if (!hashAlgorithm(hash.size(), &algorithm))
+    {
+        qWarning() << "FileReceiver: unknown hash size" << hash.size();
+        return false;
+    }
+
+    const qint64 size = ranges_.cbegin()->second;
+    QCryptographicHash file_hash(algorithm);
+    for (qint64 pos = 0; pos < size; pos += hash_chunk_size)
+        file_hash.addData(reinterpret_cast<const char*>(data_ + pos), static_cast<int>(std::min<qint64>(hash_chunk_size, size - pos)));
+
+    if (file_hash.result() != hash)
+    {
+        // Known size is covered completely, so the data is broken and is received again.
+        // Without a header the file may be just shorter, its parts are kept for resume.
+        qWarning() << "FileReceiver: hash mismatch" << file_name;
+        if (size_ >= 0)
+            clear();
+        else
+            suspend();
+        return false;
+    }
+
+    file_.unmap(data_);
+    data_ = nullptr;
+    file_.resize(size);
+    file_.close();
+    capacity_ = 0;
+
+    const QString target = QDir(dir_).filePath(QFileInfo(file_name).fileName());
+    QFile::remove(target);
+    if (!QFile::rename(file_.fileName(), target))
+    {
+        qWarning() << "FileReceiver: can't move file to" << target;
+        clear();
+        return false;
+    }
+
+    QFile::remove(file_.fileName() + ".ranges");
+    ranges_.clear();
+    hash_.clear();
+    file_name_.clear();
+    size_ = -1;
+
+    if (out_path)
+        *out_path = target;
+    return true;
+}
+
+void FileReceiver::suspend()
+{
+    if (!data_)
+        return;
+
+    // Диапазоны не должны указывать на данные, которых ещё нет на диске
+    sync();
+    saveState();
+    file_.unmap(data_);
+    data_ = nullptr;
+    file_.close();
+}
+
+void FileReceiver::clear()
+{
+    if (data_)
+        file_.unmap(data_);
+    data_ = nullptr;
+    capacity_ = 0;
+    unsaved_bytes_ = 0;
+    file_.close();
+
+    file_.remove();
+    QFile::remove(file_.fileName() + ".ranges");
+    ranges_.clear();
+    hash_.clear();
+    file_name_.clear();
+    size_ = -1;
+    state_loaded_ = true;
+}
+
+bool FileReceiver::open()
+{
+    if (data_)
+        return true;
+
+    if (!QDir().mkpath(dir_))
+    {
+        qWarning() << "FileReceiver: can't create directory" << dir_;
+        return false;
+    }
+
+    if (!state_loaded_)
+    {
+        state_loaded_ = true;
+
+        QFile state(file_.fileName() + ".ranges");
+        if (state.open(QIODevice::ReadOnly))
+        {
+            QVector<QPair<qint64, qint64>> ranges;
+            QDataStream ds(&state);
+            ds >> hash_ >> file_name_ >> size_ >> ranges;
+            if (ds.status() == QDataStream::Ok)
+            {
+                for (const auto& range: ranges)
+                    addRange(range.first, range.second);
+            }
+            else
+            {
+                hash_.clear();
+                file_name_.clear();
+                size_ = -1;
+            }
+        }
+    }
+
+    if (!file_.open(QIODevice::ReadWrite))
+    {
+        qWarning() << "FileReceiver: can't open" << file_.fileName() << file_.errorString();
+        return false;
+    }
+
+    capacity_ = file_.size();
+    if (!ranges_.empty() && ranges_.crbegin()->second > capacity_)
+    {
+        qWarning() << "FileReceiver: saved ranges don't match the file, start again";
+        ranges_.clear();
+    }
+
+    if (capacity_ > 0)
+    {
+        data_ = file_.map(0, capacity_);
+        if (!data_)
+        {
+            qWarning() << "FileReceiver: can't map" << file_.fileName() << file_.errorString();
+            file_.close();
+            return false;
+        }
+    }
+    return reserve(min_capacity);
+}
+
+bool FileReceiver::reserve(qint64 size)
+{
+    if (size <= capacity_ && data_)
+        return true;
+
+    const qint64 capacity = std::max({ size, capacity_ * 2, min_capacity });
+
+    if (data_)
+        file_.unmap(data_);
+    data_ = nullptr;
+
+    if (!file_.resize(capacity) || !(data_ = file_.map(0, capacity)))
+    {
+        qWarning() << "FileReceiver: can't allocate" << capacity << file_.errorString();
+        capacity_ = 0;
+        return false;
+    }
+
+    capacity_ = capacity;
+    return true;
+}
+
+void FileReceiver::addRange(qint64 from, qint64 to)
+{
+    auto it = ranges_.upper_bound(from);
+    if (it != ranges_.begin())
+    {
+        auto prev = std::prev(it);
+        if (prev->second >= from)
+        {
+            from = prev->first;
+            to = std::max(to, prev->second);
+            ranges_.erase(prev);
+        }
+    }
+
+    while (it != ranges_.end() && it->first <= to)
+    {
+        to = std::max(to, it->second);
+        it = ranges_.erase(it);
+    }
+
+    ranges_.emplace(from, to);
+}
+
+bool FileReceiver::isComplete() const
+{
+    if (ranges_.size() != 1 || ranges_.cbegin()->first != 0)
+        return false;
+    return size_ < 0 || ranges_.cbegin()->second == size_;
+}
+
+void FileReceiver::sync()
+{
+#ifdef Q_OS_UNIX
+    if (data_ && msync(data_, capacity_, MS_SYNC) != 0)
+        qWarning() << "FileReceiver: msync failed" << file_.fileName();
+#else
+    file_.flush();
+#endif
+}
+
+void FileReceiver::saveState()
+{
+    QFile state(file_.fileName() + ".ranges");
+    if (!state.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qWarning() << "FileReceiver: can't save state" << state.fileName() << state.errorString();
+        return;
+    }
+
+    QVector<QPair<qint64, qint64>> ranges;
+    for (const auto& range: ranges_)
+        ranges.push_back(qMakePair(range.first, range.second));
+
+    QDataStream ds(&state);
+    ds << hash_ << file_name_ << size_ << ranges;
+    unsaved_bytes_ = 0;
+}
+
+} // namespace Network
+} // namespace Dai
@@ -0,0 +1,69 @@
+#ifndef DAI_NETWORK_FILE_RECEIVER_H
+#define DAI_NETWORK_FILE_RECEIVER_H
+
+#include <map>
+
+#include <QFile>
+#include <QVector>
+
+namespace Dai {
+namespace Network {
+
+/**
+ * Приём файла частями в любом порядке.
+ * Файл заранее увеличивается и отображается в память, принятые диапазоны
+ * сохраняются рядом с файлом, поэтому после переподключения или перезапуска
+ * сервер может дослать только недостающие части.
+ */
+class FileReceiver
+{
+public:
+    explicit FileReceiver(const QString& dir);
+    ~FileReceiver();
+
+    // Заголовок файла (dai/1.2). Части другого файла, принятые раньше, удаляются.
+    // Возвращает true, если части этого файла уже есть и можно продолжить приём.
+    bool begin(const QByteArray& hash, const QString& file_name, qint64 size);
+
+    bool write(qint64 pos, const QByteArray& data);
+
+    bool hasData() const;
+    // Заполнен только после загрузки состояния, поэтому ranges() вызывается раньше
+    const QByteArray& hash() const;
+    QVector<QPair<qint64, qint64>> ranges();
+
+    // Проверяет хэш собранного файла и переносит его в file_name.
+    // Если файл принят не полностью, части остаются для докачки.
+    bool finish(const QByteArray& hash, const QString& file_name, QString* out_path = nullptr);
+
+    // Записывает отображение на диск, сохраняет принятые диапазоны и освобождает отображение
+    void suspend();
+    void clear();
+private:
+    bool open();
+    bool reserve(qint64 size);
+    void addRange(qint64 from, qint64 to);
+    bool isComplete() const;
+    void sync();
+    void saveState();
+
+    QString dir_;
+    QFile file_;
+    uchar* data_;
+    qint64 capacity_;
+    qint64 unsaved_bytes_;
+    bool state_loaded_;
+
+    // Какой файл принимается, пустой для серверов без заголовка. size -1, если не известен.
+    QByteArray hash_;
+    QString file_name_;
+    qint64 size_;
+
+    // начало -> конец (не включая)
+    std::map<qint64, qint64> ranges_;
+};
+
+} // namespace Network
+} // namespace Dai
+
+#endif // DAI_NETWORK_FILE_RECEIVER_H
@@ -2,6 +2,11 @@
 #include <QCryptographicHash>
 #include <QDataStream>
 #include <QTimeZone>
+#include <QDir>
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
 
 #include <botan/parsing.h>
 
@@ -15,6 +20,7 @@
 
 #include "worker.h"
 #include "Database/db_manager.h"
+#include "value_pack_codec.h"
 #include "n_client.h"
 
 #include "lib.h"
@@ -26,6 +32,67 @@ Q_LOGGING_CATEGORY(NetClientLog, "net.client")
 
 namespace Network {
 
+// Bounds for one cmdLogData reply
+#define LOG_DATA_CHUNK_MIN          16
+#define LOG_DATA_CHUNK_MAX          2000
+#define LOG_DATA_CHUNK_BYTES        32 * 1024
+#define LOG_DATA_CHUNK_INTERVAL     20
+
+// Пакеты значений и событий
+#define PACK_FAST_LATENCY           10
+#define PACK_VALUE_LATENCY          250
+#define PACK_EVENT_LATENCY          1000
+#define PACK_MAX_COUNT              1000
+#define PACK_MAX_BYTES              64 * 1024
+
+// Сколько пакетов очереди отправляется за один проход цикла событий
+#define OUTBOX_SEND_COUNT           256
+
+// Наибольшая пауза между попытками подключения
+#define RECONNECT_MAX_DELAY         10 * 60 * 1000
+
+namespace {
+
+// Пакет значений в очереди уже в кодировке dai/1.2, на сервер уходит как cmdChangedValues
+const quint16 cmdCompactValues = 0x7FFF;
+
+template<typename T>
+QByteArray toByteArray(const T& pack)
+{
+    QByteArray data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_5_7);
+    ds << pack;
+    return data;
+}
+
+int variantSize(const QVariant& value)
+{
+    switch (value.type()) {
+    case QVariant::String:      return 9 + value.toString().size() * 2;
+    case QVariant::ByteArray:   return 9 + value.toByteArray().size();
+    default:                    return 13;
+    }
+}
+
+int packItemSize(const ValuePackItem& item) { return 16 + variantSize(item.raw_value) + variantSize(item.value); }
+int packItemSize(const EventPackItem& item) { return 24 + (item.category.size() + item.text.size()) * 2; }
+
+template<typename T>
+QVector<T*> filterById(const QVector<T*>& items, const QVector<quint32>& ids)
+{
+    if (ids.isEmpty())
+        return items;
+
+    QVector<T*> res;
+    for (T* item: items)
+        if (ids.contains(item->id()))
+            res.push_back(item);
+    return res;
+}
+
+} // namespace
+
 void Client::sendVersion()
 {
     send(cmdVersion)
@@ -37,30 +104,80 @@ void Client::sendVersion()
         << (quint8)VER_MJ << (quint8)VER_MN << (int)VER_B;
 }
 
-Client::Client(Worker *worker, const QString &hostname, quint16 port, const QString &login, const QString &password, const QUuid &device, int checkServerInterval) :
-    Helpz::DTLS::Client(Botan::split_on("dai/1.1,dai/1.0", ','), Helpz::Database::ConnectionInfo()/*worker->database_info()*/,
+Client::Client(Worker *worker, bool mirror, const QString &hostname, quint16 port, const QString &login, const QString &password, const QUuid &device, int checkServerInterval,
+               int rate_kbps, int burst_kb, int history_rate_kbps, int history_burst_kb, bool resume_session,
+               const QString &outbox_file, int outbox_sync_ms) :
+    // TLS sessions may be kept in the local database, so a restarted client resumes it without full handshake.
+    // Off by default: the library then opens its own connection to the local database from the client thread.
+    Helpz::DTLS::Client(Botan::split_on("dai/1.2,dai/1.1,dai/1.0", ','),
+                        resume_session ? worker->database_info() : Helpz::Database::ConnectionInfo(),
                            qApp->applicationDirPath() + "/tls_policy.conf", hostname, port, checkServerInterval),
-    m_login(login), m_password(password), m_device(device), m_import_config(false),
+    m_login(login), m_password(password), m_device(device), upstream_(hostname + ':' + QString::number(port)), m_import_config(false), mirror_(mirror),
+    scheduler_([this](quint16 cmd, const QByteArray& data)
+    {
+        if (!dtls || !dtls->is_active())
+            return false;
+        send(cmd).dataStream().writeRawData(data.constData(), data.size());
+        return true;
+    }),
+    fast_value_pack_(PACK_FAST_LATENCY, PACK_MAX_COUNT, PACK_MAX_BYTES),
+    value_pack_(PACK_VALUE_LATENCY, PACK_MAX_COUNT, PACK_MAX_BYTES),
+    event_pack_(PACK_EVENT_LATENCY, PACK_MAX_COUNT, PACK_MAX_BYTES),
+    protocol_minor_(0), authorized_(false), connected_(false),
+    outbox_sync_ms_(outbox_sync_ms), outbox_ack_supported_(false), outbox_early_(false),
+    log_data_chunk_size_(500),
+    check_interval_(std::max(checkServerInterval, 1000)), reconnect_attempts_(0), next_connect_ms_(0),
+    random_(std::random_device()()),
+    file_receiver_(qApp->applicationDirPath() + "/incoming"),
     worker(worker)
 {
-    connect(&packTimer, &QTimer::timeout, this, &Client::sendPack);
-    packTimer.setSingleShot(true);
+    scheduler_.setLiveRate(rate_kbps * 1024LL, burst_kb * 1024LL);
+    scheduler_.setHistoryRate(history_rate_kbps * 1024LL, history_burst_kb * 1024LL);
+
+    connect(&fast_value_pack_.timer, &QTimer::timeout, this, &Client::sendFastValues);
+    connect(&value_pack_.timer, &QTimer::timeout, this, &Client::sendValues);
+    connect(&event_pack_.timer, &QTimer::timeout, this, &Client::sendEvents);
+
+    if (!outbox_file.isEmpty())
+    {
+        outbox_.reset(new Outbox(QDir::isRelativePath(outbox_file) ? qApp->applicationDirPath() + '/' + outbox_file : outbox_file));
+        if (!outbox_->open())
+            outbox_.reset();
+    }
+    connect(&outbox_timer_, &QTimer::timeout, this, &Client::sendOutbox);
+    outbox_timer_.setSingleShot(true);
+    connect(&outbox_sync_timer_, &QTimer::timeout, [this]() { if (outbox_) outbox_->sync(); });
+    outbox_sync_timer_.setSingleShot(true);
+
+    connect(&file_part_timer_, &QTimer::timeout, this, &Client::filePartTimeout);
+    file_part_timer_.setInterval(30000);
+    file_part_timer_.setSingleShot(true);
+
+    connect(&log_data_timer_, &QTimer::timeout, this, &Client::sendLogData);
+    log_data_timer_.setSingleShot(true);
+
+    connect(&link_timer_, &QTimer::timeout, this, &Client::checkConnection);
+    link_timer_.start(check_interval_);
 
     qRegisterMetaType<CodeItem>("CodeItem");
     qRegisterMetaType<ParamValuesPack>("ParamValuesPack");
     qRegisterMetaType<EventPackItem>("EventPackItem");
     qRegisterMetaType<std::vector<uint>>("std::vector<uint>");
 
-    connect(this, &Client::restart, worker, &Worker::serviceRestart, Qt::QueuedConnection);
-    connect(this, &Client::structModify, worker, &Worker::applyStructModify, Qt::BlockingQueuedConnection);
-    connect(this, &Client::setControlState, worker, &Worker::setControlState, Qt::QueuedConnection);
-    connect(this, &Client::writeToItem, worker, &Worker::writeToItem, Qt::QueuedConnection);
+    // Mirror only sends data, commands that change the project are accepted from the main server only
+    if (!mirror_)
+    {
+        connect(this, &Client::restart, worker, &Worker::serviceRestart, Qt::QueuedConnection);
+        connect(this, &Client::structModify, worker, &Worker::applyStructModify, Qt::BlockingQueuedConnection);
+        connect(this, &Client::setControlState, worker, &Worker::setControlState, Qt::QueuedConnection);
+        connect(this, &Client::writeToItem, worker, &Worker::writeToItem, Qt::QueuedConnection);
 
-    connect(this, &Client::setMode, worker, &Worker::setMode, Qt::QueuedConnection);
-    connect(this, &Client::setCode, worker, &Worker::setCode, Qt::BlockingQueuedConnection);
+        connect(this, &Client::setMode, worker, &Worker::setMode, Qt::QueuedConnection);
+        connect(this, &Client::setCode, worker, &Worker::setCode, Qt::BlockingQueuedConnection);
 
-//    connect(this, &Client::lostValues, worker, &Worker::sendLostValues, Qt::QueuedConnection);
-    connect(this, &Client::setParamValues, worker, &Worker::setParamValues, Qt::QueuedConnection);
+//        connect(this, &Client::lostValues, worker, &Worker::sendLostValues, Qt::QueuedConnection);
+        connect(this, &Client::setParamValues, worker, &Worker::setParamValues, Qt::QueuedConnection);
+    }
 
 // -----> Sync database
     connect(this, &Client::getLogRange, worker->database(), &DBManager::getLogRange, Qt::BlockingQueuedConnection);
@@ -68,21 +185,26 @@ Client::Client(Worker *worker, const QString &hostname, quint16 port, const QStr
 // <--------------------
 
     connect(worker, &Worker::paramValuesChanged, this, &Client::sendParamValues, Qt::QueuedConnection);
-    connect(worker, &Worker::change, this, &Client::change, Qt::QueuedConnection);
+    // Each client packs values in its own thread, so a stalled client doesn't hold the others
+    connect(worker, &Worker::valueBatch, this, &Client::changeBatch, Qt::QueuedConnection);
     connect(worker, &Worker::modeChanged, this, &Client::modeChanged, Qt::QueuedConnection);
     connect(worker, &Worker::groupStatusChanged, this, &Client::groupStatusChanged, Qt::QueuedConnection);
     connect(worker, &Worker::statusAdded, this, &Client::statusAdded, Qt::QueuedConnection);
     connect(worker, &Worker::statusRemoved, this, &Client::statusRemoved, Qt::QueuedConnection);
+    connect(worker, &Worker::structureChanged, this, &Client::structureChanged, Qt::QueuedConnection);
 
     while (!worker->prj->ptr() && !worker->prj->wait(5));
     prj = worker->prj->ptr();
 
     connect(this, &Client::getServerInfo, worker->prj->ptr(), &Project::dumpInfoToStream, Qt::DirectConnection);
-    connect(this, &Client::setServerInfo, worker->prj->ptr(), &Project::initFromStream, Qt::BlockingQueuedConnection);
-    connect(this, &Client::saveServerInfo, worker->database(), &Database::saveProject, Qt::BlockingQueuedConnection);
-    connect(this, &Client::execScript, worker->prj->ptr(), &ScriptedProject::console, Qt::QueuedConnection);
+    if (!mirror_)
+    {
+        connect(this, &Client::setServerInfo, worker->prj->ptr(), &Project::initFromStream, Qt::BlockingQueuedConnection);
+        connect(this, &Client::saveServerInfo, worker->database(), &Database::saveProject, Qt::BlockingQueuedConnection);
+        connect(this, &Client::execScript, worker->prj->ptr(), &ScriptedProject::console, Qt::QueuedConnection);
+    }
 
-    if (canConnect())
+    if (hasCredentials())
         init_client();
 }
 
@@ -101,24 +223,62 @@ const QUuid& Client::device() const { return m_device; }
 const QString &Client::username() const { return m_login; }
 
 bool Client::canConnect() const
+{
+    if (!hasCredentials())
+        return false;
+
+    // Sites must not reconnect all at once after server restart, see scheduleReconnect
+    return QDateTime::currentMSecsSinceEpoch() >= next_connect_ms_;
+}
+
+bool Client::hasCredentials() const
 {
     return !(/*m_device.isNull() || */m_login.isEmpty() || m_password.isEmpty());
 }
 
+QJsonObject Client::packStats() const
+{
+    QJsonObject obj;
+    obj["send"] = scheduler_.stats();
+    obj["fast_values"] = fast_value_pack_.stats();
+    obj["values"] = value_pack_.stats();
+    obj["events"] = event_pack_.stats();
+    return obj;
+}
+
 //void Client::setId(int id) { m_id = id; }
 
-void Client::change(const ValuePackItem& item, bool immediately)
+void Client::change(const ValuePackItem& item, bool immediately, bool coalesce)
 {
-    value_pack_.push_back(item);
-    packTimer.start(immediately ? 10 : 250);
+    PackLane<ValuePackItem>& lane = immediately ? fast_value_pack_ : value_pack_;
+
+    // Intermediate values are kept in the local log and come to the server with log sync
+    bool full = coalesce ? lane.pushLatest(item.item_id, item, packItemSize(item))
+                         : lane.push(item, packItemSize(item));
+    if (full)
+    {
+        if (immediately)
+            sendFastValues();
+        else
+            sendValues();
+    }
+}
+
+void Client::changeBatch(const ValueBatchPtr &batch)
+{
+    for (int i = 0; i < batch->items().size(); ++i)
+    {
+        const quint8 flags = batch->flags().at(i);
+        change(batch->items().at(i), flags & ValueBatch::Immediately, flags & ValueBatch::Coalesce);
+    }
 }
 
 void Client::eventLog(const EventPackItem& item)
 {
     if (item.type_id == QtDebugMsg && item.category.startsWith("net"))
         return;
-    event_pack_.push_back(item);
-    packTimer.start(1000);
+    if (event_pack_.push(item, packItemSize(item)))
+        sendEvents();
 //    auto helper = send(cmdEventMessage);
 //    helper << type << category << text << time << db_id;
 //    events_data += helper.pop_message();
@@ -126,20 +286,20 @@ void Client::eventLog(const EventPackItem& item)
 
 void Client::modeChanged(uint mode_id, quint32 group_id) {
     qDebug(NetClientLog) << "modeChanged" << mode_id << group_id;
-    send(cmdChangedMode) << mode_id << group_id;
+    queue(SendScheduler::StatusLane, cmdChangedMode, mode_id, group_id);
 }
 
 void Client::statusAdded(quint32 group_id, quint32 info_id, const QStringList &args) {
-    send(cmdGroupStatusAdded) << group_id << info_id << args;
+    queue(SendScheduler::StatusLane, cmdGroupStatusAdded, group_id, info_id, args);
 }
 
 void Client::statusRemoved(quint32 group_id, quint32 info_id) {
-    send(cmdGroupStatusRemoved) << group_id << info_id;
+    queue(SendScheduler::StatusLane, cmdGroupStatusRemoved, group_id, info_id);
 }
 
 void Client::groupStatusChanged(quint32 group_id, quint32 status)
 {
-    send(cmdChangedStatus) << group_id << status;
+    queue(SendScheduler::StatusLane, cmdChangedStatus, group_id, status);
 }
 
 //void Client::sendLostValues(const QVector<ValuePackItem> &valuesPack) {
@@ -151,7 +311,7 @@ void Client::groupStatusChanged(quint32 group_id, quint32 status)
 
 void Client::sendParamValues(const ParamValuesPack &pack)
 {
-    send(cmdSetParamValues) << pack;
+    queue(SendScheduler::ControlLane, cmdSetParamValues, pack);
 }
 
 void Client::setDevice(const QUuid &devive_uuid)
@@ -184,11 +344,14 @@ void Client::setImportFlag(bool import_config)
 
 void Client::refreshAuth(const QUuid &devive_uuid, const QString &username, const QString &password)
 {
+    connectionLost();
     close_connection();
     setDevice(devive_uuid);
     setLogin(username);
     setPassword(password);
-    if (canConnect())
+    reconnect_attempts_ = 0;
+    next_connect_ms_ = 0;
+    if (hasCredentials())
         init_client();
 }
 
@@ -243,13 +406,46 @@ QVector<QPair<QUuid, QString>> Client::getUserDevices()
     return lastUserDevices;
 }
 
+bool Client::isProjectCommand(quint16 cmd)
+{
+    switch (cmd) {
+    case cmdServerInfo:
+    case cmdSetControlState:
+    case cmdWriteToItem:
+    case cmdSetMode:
+    case cmdSetParamValues:
+    case cmdSetCode:
+    case cmdRestart:
+    case cmdExecScript:
+    case cmdStructModify:
+    case cmdFileHeader:
+    case cmdFilePart:
+    case cmdFileHash:
+        return true;
+    default:
+        return false;
+    }
+}
+
 void Client::proccessMessage(quint16 cmd, QDataStream &msg)
 {
+    if (mirror_ && isProjectCommand(cmd))
+    {
+        qCWarning(NetClientLog) << "Mirror is send-only, command is ignored" << cmd;
+        // The server waits for an answer to these
+        if (cmd == cmdSetCode || cmd == cmdStructModify)
+            queue(SendScheduler::ControlLane, cmd, false);
+        return;
+    }
+
     switch(cmd)
     {
     case cmdNoAuth:
 //        qDebug() << "NoAuth";
         // send(cmdAuth) << m_login << m_password << m_device;
+        authorized_ = false;
+        outbox_early_ = false;
+        scheduler_.setPaused(true);
         sendAuthInfo();
         break;
     case cmdAuth:
@@ -257,6 +453,22 @@ void Client::proccessMessage(quint16 cmd, QDataStream &msg)
         bool authorized = Helpz::parse<bool>(msg);
         qDebug(NetClientLog) << "Auth" << authorized;
 
+        authorized_ = authorized;
+        // A server that accepts the link but rejects auth or drops right after it keeps the backoff growing
+        if (authorized_)
+            reconnect_attempts_ = 0;
+        scheduler_.setPaused(!authorized_);
+        if (authorized_ && !outbox_early_)
+            startOutboxSession();
+        outbox_early_ = false;
+
+        if (authorized_ && protocol_minor_ >= 2 && file_receiver_.hasData())
+        {
+            // ranges() loads the saved state, hash() is valid only after it
+            const QVector<QPair<qint64, qint64>> ranges = file_receiver_.ranges();
+            send(cmdFileResume) << file_receiver_.hash() << ranges;
+        }
+
         if (!authorized)
         {
             lastUserDevices = Helpz::parse<QVector<QPair<QUuid, QString>>>(msg);
@@ -286,6 +498,7 @@ void Client::proccessMessage(quint16 cmd, QDataStream &msg)
         QVector<ParamTypeItem> param_values;
         emit setServerInfo(&msg, &param_values);
         emit saveServerInfo(param_values, worker->prj->ptr());
+        structure_hash_.clear();
 
         auto wait_it = wait_map.find(cmdGetServerInfo);
         if (wait_it != wait_map.cend())
@@ -298,17 +511,26 @@ void Client::proccessMessage(quint16 cmd, QDataStream &msg)
         sendVersion();
         send(cmdDateTime) << dt << dt.timeZone();
 
-        send(cmdItemTypeList) << prj->ItemTypeMng;
-        send(cmdGroupTypeList) << prj->GroupTypeMng;
-        send(cmdModeTypeLIst) << prj->ModeTypeMng;
-        send(cmdSignList) << prj->SignMng;
-        send(cmdStatusTypeList) << prj->StatusTypeMng;
-        send(cmdStatusList) << prj->StatusMng;
-        send(cmdParamList) << prj->ParamMng;
+        if (protocol_minor_ >= 2)
+        {
+            // Server asks only for parts that differ
+            structure_hash_.clear();
+            const StructureHash& hash = structureHash();
+            queue(SendScheduler::ControlLane, cmdStructureHash, hash.root, hash.parts);
+            break;
+        }
 
-        send(cmdCodesChecksum) << prj->get_codes_checksum();
+        queue(SendScheduler::BulkLane, cmdItemTypeList, prj->ItemTypeMng);
+        queue(SendScheduler::BulkLane, cmdGroupTypeList, prj->GroupTypeMng);
+        queue(SendScheduler::BulkLane, cmdModeTypeLIst, prj->ModeTypeMng);
+        queue(SendScheduler::BulkLane, cmdSignList, prj->SignMng);
+        queue(SendScheduler::BulkLane, cmdStatusTypeList, prj->StatusTypeMng);
+        queue(SendScheduler::BulkLane, cmdStatusList, prj->StatusMng);
+        queue(SendScheduler::BulkLane, cmdParamList, prj->ParamMng);
 
-        send(cmdServerStructureInfo) << prj->sections() << prj->devices();
+        queue(SendScheduler::BulkLane, cmdCodesChecksum, prj->get_codes_checksum());
+
+        queue(SendScheduler::BulkLane, cmdServerStructureInfo, prj->sections(), prj->devices());
         break;
 
 //        QByteArray dateData;
@@ -343,11 +565,12 @@ void Client::proccessMessage(quint16 cmd, QDataStream &msg)
         break;
 
     case cmdSetCode:
-        send(cmd) << applyParse(&Client::setCode, msg);
+        queue(SendScheduler::ControlLane, cmd, applyParse(&Client::setCode, msg));
+        structure_hash_.clear();
         break;
 
     case cmdGetCode:
-        send(cmd) << Helpz::applyParse(&CodeManager::type, &prj->CodeMng, msg);
+        queue(SendScheduler::ControlLane, cmd, Helpz::applyParse(&CodeManager::type, &prj->CodeMng, msg));
         break;
 
     case cmdRestart:
@@ -367,7 +590,7 @@ void Client::proccessMessage(quint16 cmd, QDataStream &msg)
             if (log_type != Dai::ValueLog && log_type != Dai::EventLog)
                 break;
 
-            send(cmd) << log_type << getLogRange(log_type, date_ms);
+            queue(SendScheduler::ControlLane, cmd, log_type, getLogRange(upstream_, log_type, date_ms));
         }
         break;
     }
@@ -375,76 +598,91 @@ void Client::proccessMessage(quint16 cmd, QDataStream &msg)
     case cmdLogData: {
         uint8_t log_type; QPair<quint32, quint32> range;
         Helpz::parse_out(msg, log_type, range);
-        if (log_type != Dai::ValueLog && log_type != Dai::EventLog)
+        if ((log_type != Dai::ValueLog && log_type != Dai::EventLog) || range.first > range.second)
             break;
 
-        auto res = getLogData(log_type, range);
-#if (__cplusplus > 201402L) && (!defined(__GNUC__) || (__GNUC__ >= 7))
-        try {
-            switch (log_type) {
-            case ValueLog: send(cmd) << log_type << res.not_found << std::get<0>(res.data); break;
-            case EventLog: send(cmd) << log_type << res.not_found << std::get<1>(res.data); break;
-            default: break;
-            }
-        }
-        catch (const std::bad_variant_access&) {}
-#else
-        switch (log_type) {
-            case ValueLog: send(cmd) << log_type << res.not_found << res.data_value; break;
-            case EventLog: send(cmd) << log_type << res.not_found << res.data_event; break;
-        default: break;
-        }
-#endif
+        // Big ranges are sent by parts, see sendLogData
+        LogDataRequest request;
+        request.log_type = log_type;
+        request.range = range;
+        request.next_id = range.first;
+        log_data_queue_.push_back(std::move(request));
+        if (!log_data_timer_.isActive())
+            log_data_timer_.start(0);
         break;
     }
 // <--------------------
 
+    case cmdStructurePartHash: {
+        quint8 part = Helpz::parse<quint8>(msg);
+        if (part == StructureHash::pSections)
+            queue(SendScheduler::ControlLane, cmd, part, structureHash().sections);
+        else if (part == StructureHash::pDevices)
+            queue(SendScheduler::ControlLane, cmd, part, structureHash().devices);
+        break;
+    }
+
+    case cmdStructurePart: {
+        quint8 part; QVector<quint32> ids;
+        Helpz::parse_out(msg, part, ids);
+        sendStructurePart(part, ids);
+        break;
+    }
+
+    case cmdOutboxAck:
+        outboxAck(Helpz::parse<quint64>(msg));
+        break;
+
 // -----> Struct modify
     case cmdStructModify: {
         quint8 modifyType;
         Helpz::parse_out(msg, modifyType);
         qCDebug(NetClientLog) << "Received strucrure modify" << (StructureType)modifyType << "size" << msg.device()->size();
-        send(cmd) << structModify(modifyType, &msg);
+        queue(SendScheduler::ControlLane, cmd, structModify(modifyType, &msg));
+        structure_hash_.clear();
         break;
     }
 // <--------------------
 
-    case cmdFilePart:
+    case cmdFileHeader:
     {
-        if (!fileInfo)
-        {
-            fileInfo.reset(new ReceiveFileInfo);
-            if (!fileInfo->file.open())
-            {
-                qCWarning(NetClientLog).noquote() << "Receive file fail." << fileInfo->file.errorString();
-                fileInfo.reset();
-                break;
-            }
+        QByteArray fileHash;
+        QString fileName;
+        qint64 size;
+        Helpz::parse_out(msg, fileHash, fileName, size);
 
-            connect(&fileInfo->timer, &QTimer::timeout, this, &Client::filePartTimeout);
+        // Parts of this file are already here, server sends only the rest
+        if (file_receiver_.begin(fileHash, fileName, size))
+        {
+            const QVector<QPair<qint64, qint64>> ranges = file_receiver_.ranges();
+            send(cmdFileResume) << file_receiver_.hash() << ranges;
         }
-
+        break;
+    }
+    case cmdFilePart:
+    {
         FilePart filePart;
         msg >> filePart;
 
-        if (fileInfo->file.pos() != filePart.pos)
-        {
-            if (fileInfo->file.size() <= filePart.pos)
-                fileInfo->file.resize(filePart.pos + 1);
-            fileInfo->file.seek(filePart.pos);
-        }
-        fileInfo->file.write(filePart.data);
-        fileInfo->hash.addData(filePart.data);
-
-        fileInfo->timer.start();
+        if (!file_receiver_.write(filePart.pos, filePart.data))
+            qCWarning(NetClientLog).noquote() << "Receive file fail. Part" << filePart.pos << filePart.data.size();
+        file_part_timer_.start();
         break;
     }
     case cmdFileHash:
     {
         QByteArray fileHash;
-        QString fileName;
+        QString fileName, path;
 
         msg >> fileHash >> fileName;
+        file_part_timer_.stop();
+
+        if (file_receiver_.finish(fileHash, fileName, &path))
+            qCDebug(NetClientLog).noquote() << "File received" << path;
+        else if (protocol_minor_ >= 2)
+            send(cmdFileResume) << fileHash << file_receiver_.ranges();
+        else
+            file_receiver_.clear(); // old server sends the whole file again
         break;
     }
 
@@ -455,29 +693,192 @@ void Client::proccessMessage(quint16 cmd, QDataStream &msg)
     }
 }
 
-void Client::sendPack()
+void Client::sendFastValues()
+{
+    if (fast_value_pack_.isEmpty())
+        return;
+
+    pushValues(fast_value_pack_.take());
+    sendOutbox();
+}
+
+void Client::sendValues()
+{
+    if (value_pack_.isEmpty())
+        return;
+
+//    qCDebug(NetClientLog) << "Send changes count" << pack.item_size();
+    pushValues(value_pack_.take());
+    sendOutbox();
+}
+
+void Client::sendEvents()
+{
+    if (event_pack_.isEmpty())
+        return;
+
+//    std::cout << "Send events size" << event_pack_.size() << std::endl;
+    pushToOutbox(cmdEventMessage, toByteArray(event_pack_.take()));
+    sendOutbox();
+}
+
+void Client::pushValues(const QVector<ValuePackItem> &pack)
+{
+    // Pack is encoded once and kept in dai/1.2 format, only old servers need transcoding on send
+    // A type without stream operators can't be written in the old format either, so the pack is dropped
+    QByteArray data = ValuePackCodec::encode(pack);
+    if (data.isEmpty())
+        qCWarning(NetClientLog) << "Pack has a value type that can't be serialized, dropped" << pack.size();
+    else
+        pushToOutbox(cmdCompactValues, data);
+}
+
+void Client::pushToOutbox(quint16 cmd, const QByteArray &data)
+{
+    if (outbox_ && outbox_->push(cmd, data))
+    {
+        // Pack is on disk only after fsync, it's done once per interval for all packs written in it
+        if (outbox_sync_ms_ == 0)
+            outbox_->sync();
+        else if (outbox_sync_ms_ > 0 && !outbox_sync_timer_.isActive())
+            outbox_sync_timer_.start(outbox_sync_ms_);
+    }
+    else
+    {
+        if (authorized_)
+            sendPackData(cmd, data);
+        else
+            qCWarning(NetClientLog) << "Pack is lost" << cmd << data.size();
+    }
+}
+
+void Client::sendPackData(quint16 cmd, const QByteArray &data, quint64 seq)
 {
-    if (value_pack_.size())
+    QByteArray out = data;
+    if (cmd == cmdCompactValues)
     {
-//        qCDebug(NetClientLog) << "Send changes count" << pack.item_size();
-        send(cmdChangedValues) << value_pack_;
-        value_pack_.clear();
+        cmd = cmdChangedValues;
+        if (protocol_minor_ < 2)
+        {
+            // Skipped pack is acked together with the next one
+            QVector<ValuePackItem> pack;
+            if (!ValuePackCodec::decode(data, &pack))
+            {
+                qCWarning(NetClientLog) << "Broken pack in outbox" << seq;
+                return;
+            }
+            out = toByteArray(pack);
+        }
+    }
+    else if (cmd == cmdChangedValues && protocol_minor_ >= 2)
+    {
+        // Pack that wasn't encoded for dai/1.2 when queued
+        QVector<ValuePackItem> pack;
+        QDataStream ds(data);
+        ds.setVersion(QDataStream::Qt_5_7);
+        ds >> pack;
+
+        out = ValuePackCodec::encode(pack);
+        if (out.isEmpty())
+        {
+            qCWarning(NetClientLog) << "Pack can't be encoded in dai/1.2 format" << seq;
+            return;
+        }
     }
 
-    if (event_pack_.size())
+    SendScheduler::SentFunc on_sent;
+    if (seq)
     {
-//        std::cout << "Send events size" << event_pack_.size() << std::endl;
-        send(cmdEventMessage) << event_pack_;
-        event_pack_.clear();
+        // The server acks packs by the number that goes right before each of them.
+        // Old server doesn't confirm packs, so a pack leaves the outbox when it is written to the connection
+        if (outbox_ack_supported_)
+            queue(SendScheduler::TelemetryLane, cmdOutboxSeq, seq);
+        else
+            on_sent = [this, seq]() { outbox_->ack(seq); };
     }
+
+    scheduler_.push(SendScheduler::TelemetryLane, cmd, out, std::move(on_sent));
+}
+
+void Client::startOutboxSession()
+{
+    if (!outbox_)
+        return;
+
+    // New session, so everything that wasn't acknowledged is sent again
+    outbox_->rewind();
+    outbox_timer_.start(0);
+}
+
+void Client::sendOutbox()
+{
+    if (!outbox_ || !(authorized_ || outbox_early_))
+        return;
+
+    if (scheduler_.queuedBytes(SendScheduler::TelemetryLane) > PACK_MAX_BYTES)
+    {
+        outbox_timer_.start(PACK_FAST_LATENCY);
+        return;
+    }
+
+    quint16 cmd;
+    quint64 seq;
+    QByteArray data;
+    for (int i = 0; i < OUTBOX_SEND_COUNT && outbox_->next(&cmd, &data, &seq); ++i)
+        sendPackData(cmd, data, seq);
+
+    if (outbox_->hasUnsent())
+        outbox_timer_.start(0);
+}
+
+void Client::outboxAck(quint64 seq)
+{
+    // First ack comes right after auth with the last number the server has got
+    outbox_ack_supported_ = true;
+    if (outbox_ && seq)
+        outbox_->ack(seq);
 }
 
 void Client::filePartTimeout()
 {
-    if (!fileInfo)
+    // Received parts are kept for resume after reconnect
+    file_receiver_.suspend();
+}
+
+void Client::checkConnection()
+{
+    if (dtls && dtls->is_active())
         return;
 
-    fileInfo.reset();
+    if (connected_)
+    {
+        qCDebug(NetClientLog) << "Connection lost";
+        connectionLost();
+    }
+    // The library had a check interval to connect and didn't
+    else if (hasCredentials() && QDateTime::currentMSecsSinceEpoch() >= next_connect_ms_)
+        scheduleReconnect();
+}
+
+void Client::connectionLost()
+{
+    // Nothing is sent until the next connection is authorized, queued packs stay in the outbox
+    connected_ = false;
+    authorized_ = false;
+    outbox_early_ = false;
+    scheduler_.setPaused(true);
+    outbox_timer_.stop();
+    log_data_timer_.stop();
+
+    scheduleReconnect();
+}
+
+void Client::scheduleReconnect()
+{
+    const qint64 delay_ms = std::min<qint64>(RECONNECT_MAX_DELAY, static_cast<qint64>(check_interval_) << std::min(reconnect_attempts_, 16));
+    std::uniform_int_distribution<qint64> jitter(delay_ms / 2, delay_ms);
+    next_connect_ms_ = QDateTime::currentMSecsSinceEpoch() + jitter(random_);
+    ++reconnect_attempts_;
 }
 
 void Client::sendAuthInfo()
@@ -485,15 +886,123 @@ void Client::sendAuthInfo()
     send(cmdAuth) << m_login << m_password << m_device;
 }
 
-void Client::sendLogData(uint8_t log_type, const QPair<quint32, quint32> &range)
+const StructureHash &Client::structureHash()
 {
+    if (structure_hash_.isEmpty())
+        structure_hash_ = StructureHash::build(prj);
+    return structure_hash_;
+}
 
+void Client::structureChanged()
+{
+    structure_hash_.clear();
+}
+
+void Client::sendStructurePart(quint8 part, const QVector<quint32> &ids)
+{
+    switch (part) {
+    case StructureHash::pItemTypes:     queue(SendScheduler::BulkLane, cmdItemTypeList, prj->ItemTypeMng); break;
+    case StructureHash::pGroupTypes:    queue(SendScheduler::BulkLane, cmdGroupTypeList, prj->GroupTypeMng); break;
+    case StructureHash::pModeTypes:     queue(SendScheduler::BulkLane, cmdModeTypeLIst, prj->ModeTypeMng); break;
+    case StructureHash::pSigns:         queue(SendScheduler::BulkLane, cmdSignList, prj->SignMng); break;
+    case StructureHash::pStatusTypes:   queue(SendScheduler::BulkLane, cmdStatusTypeList, prj->StatusTypeMng); break;
+    case StructureHash::pStatuses:      queue(SendScheduler::BulkLane, cmdStatusList, prj->StatusMng); break;
+    case StructureHash::pParams:        queue(SendScheduler::BulkLane, cmdParamList, prj->ParamMng); break;
+    case StructureHash::pCodes:         queue(SendScheduler::BulkLane, cmdCodesChecksum, prj->get_codes_checksum()); break;
+    case StructureHash::pSections:      queue(SendScheduler::BulkLane, cmdStructurePart, part, filterById(prj->sections(), ids)); break;
+    case StructureHash::pDevices:       queue(SendScheduler::BulkLane, cmdStructurePart, part, filterById(prj->devices(), ids)); break;
+    default:
+        qCWarning(NetClientLog) << "Unknown structure part" << part;
+        break;
+    }
+}
+
+void Client::sendLogData()
+{
+    if (log_data_queue_.empty())
+        return;
+
+    // Next part is made when the previous one is almost sent
+    if (scheduler_.queuedBytes(SendScheduler::BulkLane) > LOG_DATA_CHUNK_BYTES)
+    {
+        log_data_timer_.start(LOG_DATA_CHUNK_INTERVAL);
+        return;
+    }
+
+    // Forward-only cursor over ids: only the current window is read and kept in memory.
+    // Every window is a complete cmdLogData reply, old servers get the same replies
+    LogDataRequest& request = log_data_queue_.front();
+    const quint32 count = log_data_chunk_size_;
+    QPair<quint32, quint32> window(request.next_id, request.range.second);
+    if (window.second - window.first >= count)
+        window.second = window.first + count - 1;
+
+    auto res = getLogData(upstream_, request.log_type, window);
+
+    QByteArray data;
+    {
+        QDataStream ds(&data, QIODevice::WriteOnly);
+        ds.setVersion(QDataStream::Qt_5_7);
+        ds << request.log_type << res.not_found;
+#if (__cplusplus > 201402L) && (!defined(__GNUC__) || (__GNUC__ >= 7))
+        if (auto values = std::get_if<QVector<ValuePackItem>>(&res.data))
+            ds << *values;
+        else if (auto events = std::get_if<QVector<EventPackItem>>(&res.data))
+            ds << *events;
+#else
+        if (request.log_type == ValueLog)
+            ds << res.data_value;
+        else
+            ds << res.data_event;
+#endif
+    }
+
+    if (window.second >= request.range.second)
+        log_data_queue_.pop_front();
+    else
+        request.next_id = window.second + 1;
+
+    scheduler_.push(SendScheduler::BulkLane, cmdLogData, data);
+
+    // Keep every reply near LOG_DATA_CHUNK_BYTES
+    if (data.size() > LOG_DATA_CHUNK_BYTES)
+        log_data_chunk_size_ = std::max<quint32>(LOG_DATA_CHUNK_MIN, log_data_chunk_size_ / 2);
+    else if (data.size() < LOG_DATA_CHUNK_BYTES / 2 && window.second - window.first + 1 == count)
+        log_data_chunk_size_ = std::min<quint32>(LOG_DATA_CHUNK_MAX, log_data_chunk_size_ * 2);
+
+    // Give the event loop a chance to process other messages between parts
+    if (!log_data_queue_.empty())
+        log_data_timer_.start(LOG_DATA_CHUNK_INTERVAL);
 }
 
 void Client::readyWrite()
 {
-    qCDebug(NetClientLog) << "Connected. Server choose protocol:" << dtls->application_protocol().c_str();
+    const std::string protocol = dtls->application_protocol();
+    qCDebug(NetClientLog) << "Connected. Server choose protocol:" << protocol.c_str();
+
+    // Replies and packs of the previous connection aren't needed, outbox sends packs again
+    scheduler_.setPaused(true);
+    scheduler_.clear(SendScheduler::ControlLane);
+    scheduler_.clear(SendScheduler::TelemetryLane);
+    scheduler_.clear(SendScheduler::BulkLane);
+    log_data_queue_.clear();
+
+    // dai/1.2 - compact cmdChangedValues and structure sync by hashes
+    protocol_minor_ = protocol.compare(0, 6, "dai/1.") == 0 ? std::atoi(protocol.c_str() + 6) : 0;
+    connected_ = true;
+    authorized_ = false;
+    next_connect_ms_ = 0;
     sendAuthInfo();
+
+    // Server that confirms packs drops them when auth fails and they are sent again,
+    // so the backlog may go right after auth info without waiting for the answer.
+    // Other lanes wait for the answer.
+    outbox_early_ = outbox_ && outbox_ack_supported_;
+    if (outbox_early_)
+    {
+        scheduler_.setPaused(SendScheduler::TelemetryLane, false);
+        startOutboxSession();
+    }
 }
 
 } // namespace Network
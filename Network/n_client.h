@@ -6,6 +6,9 @@
 #include <QTimer>
 #include <QUuid>
 
+#include <deque>
+#include <random>
+
 #include <Helpz/simplethread.h>
 #include <Helpz/dtlsclient.h>
 #include <Helpz/waithelper.h>
@@ -16,6 +19,12 @@
 #include <plus/dai/network.h>
 
 #include "Database/db_manager.h"
+#include "outbox.h"
+#include "pack_lane.h"
+#include "structure_hash.h"
+#include "file_receiver.h"
+#include "send_scheduler.h"
+#include "value_batch.h"
 
 QT_BEGIN_NAMESPACE
 class QSettings;
@@ -29,18 +38,42 @@ class Worker;
 
 namespace Network {
 
+// Команды, которых нет в Dai/commands.h
+enum ClientCmd : quint16 {
+    cmdOutboxAck = 0x7F00, // quint64 - номер последнего пакета очереди, принятого сервером
+
+    // Структура по контрольным суммам, только dai/1.2
+    cmdStructureHash,       // root, parts hashes
+    cmdStructurePartHash,   // part -> part, items hashes
+    cmdStructurePart,       // part, ids (пустой - все) -> part data
+
+    cmdFileResume,          // хэш и принятые диапазоны файла, сервер досылает остальное
+    cmdFileHeader,          // хэш, имя и размер файла перед его частями
+
+    cmdOutboxSeq,           // quint64 - номер следующего за ним пакета очереди
+};
+
 class Client : public Helpz::DTLS::Client
 {
     Q_OBJECT
     void sendVersion();
 public:
-    Client(Worker *worker, const QString& hostname, quint16 port, const QString& login, const QString& password, const QUuid& device, int checkServerInterval);
+    // mirror - зеркало только отправляет данные, команды, меняющие проект, и файлы не принимает.
+    // Пакеты каждый клиент собирает сам в своём потоке.
+    // outbox_file пустой - очереди на диске нет. outbox_sync_ms - как часто очередь
+    // записывается на диск через fsync: 0 - после каждого пакета, меньше нуля - никогда
+    Client(Worker *worker, bool mirror, const QString& hostname, quint16 port, const QString& login, const QString& password, const QUuid& device, int checkServerInterval,
+           int rate_kbps = 0, int burst_kb = 0, int history_rate_kbps = 0, int history_burst_kb = 0, bool resume_session = false,
+           const QString& outbox_file = "outbox.dat", int outbox_sync_ms = 1000);
 
 //    static void packValue(Prt::ValuesPack* pack, uint item_id, const DeviceItem::ValueType &raw, const DeviceItem::ValueType &val, uint time, uint db_id);
     const QUuid& device() const;
     const QString& username() const;
 
     bool canConnect() const override;
+
+    // Thread-safe
+    QJsonObject packStats() const;
 signals:
     void restart();
     void getServerInfo(QDataStream* ds) const;
@@ -57,8 +90,8 @@ signals:
     void setParamValues(const ParamValuesPack& pack);
 
 // -----> Sync database
-    QPair<quint32, quint32> getLogRange(quint8 log_type, qint64 date);
-    Dai::DBManager::LogDataT getLogData(quint8 log_type, const QPair<quint32, quint32>& range);
+    QPair<quint32, quint32> getLogRange(const QString& upstream, quint8 log_type, qint64 date);
+    Dai::DBManager::LogDataT getLogData(const QString& upstream, quint8 log_type, const QPair<quint32, quint32>& range);
 // <--------------------
 
 public slots:
@@ -71,7 +104,8 @@ public slots:
     QUuid createDevice(const QString& name, const QString &latin, const QString& description);
 
 //    void setId(int id);
-    void change(const ValuePackItem &item, bool immediately = false);
+    void change(const ValuePackItem &item, bool immediately = false, bool coalesce = false);
+    void changeBatch(const Dai::ValueBatchPtr& batch);
 
     void eventLog(const EventPackItem &item);
 
@@ -87,26 +121,87 @@ public slots:
     void sendParamValues(const ParamValuesPack& pack);
 
     QVector<QPair<QUuid, QString>> getUserDevices();
+
+    // Суммы структуры считаются заново при следующем запросе
+    void structureChanged();
 protected:
     void readyWrite() override;
     void proccessMessage(quint16 cmd, QDataStream &msg) override;
 private slots:
-    void sendPack();
+    void sendFastValues();
+    void sendValues();
+    void sendEvents();
+    void sendOutbox();
+    void sendLogData();
 
     void filePartTimeout();
+    void checkConnection();
 private:
+    void connectionLost();
+    void scheduleReconnect();
+    bool hasCredentials() const;
     void sendAuthInfo();
-    void sendLogData(uint8_t log_type, const QPair<quint32, quint32>& range);
+    // Команды, меняющие проект, и приём файлов, зеркалу не положены
+    static bool isProjectCommand(quint16 cmd);
+    void startOutboxSession();
+
+    template<typename... Args>
+    void queue(SendScheduler::Lane lane, quint16 cmd, const Args&... args)
+    {
+        QByteArray data;
+        QDataStream ds(&data, QIODevice::WriteOnly);
+        ds.setVersion(QDataStream::Qt_5_7);
+        using expand = int[];
+        (void)expand{0, ((void)(ds << args), 0)...};
+        scheduler_.push(lane, cmd, data);
+    }
+    const StructureHash& structureHash();
+    void sendStructurePart(quint8 part, const QVector<quint32>& ids);
+    void pushValues(const QVector<ValuePackItem>& pack);
+    void pushToOutbox(quint16 cmd, const QByteArray& data);
+    void sendPackData(quint16 cmd, const QByteArray& data, quint64 seq = 0);
+    void outboxAck(quint64 seq);
 
     QString m_login, m_password;
     QUuid m_device;
+    // host:port, ключ курсора синхронизации журнала в базе
+    QString upstream_;
     bool m_import_config;
-
-    QTimer packTimer;
-    QVector<ValuePackItem> value_pack_;
-    QVector<EventPackItem> event_pack_;
-
-    std::unique_ptr<ReceiveFileInfo> fileInfo;
+    bool mirror_;
+
+    SendScheduler scheduler_;
+
+    PackLane<ValuePackItem> fast_value_pack_, value_pack_;
+    PackLane<EventPackItem> event_pack_;
+
+    quint8 protocol_minor_;
+    StructureHash structure_hash_;
+    bool authorized_;
+    bool connected_;
+    // Библиотека не сообщает о разрыве, соединение проверяется по таймеру
+    QTimer link_timer_;
+    std::unique_ptr<Outbox> outbox_;
+    QTimer outbox_timer_, outbox_sync_timer_;
+    int outbox_sync_ms_;
+    bool outbox_ack_supported_;
+    bool outbox_early_;
+
+    struct LogDataRequest {
+        uint8_t log_type;
+        QPair<quint32, quint32> range;
+        quint32 next_id; // начало следующего окна, данные окна в памяти не хранятся
+    };
+    std::deque<LogDataRequest> log_data_queue_;
+    QTimer log_data_timer_;
+    quint32 log_data_chunk_size_;
+
+    int check_interval_;
+    int reconnect_attempts_;
+    qint64 next_connect_ms_;
+    std::mt19937 random_;
+
+    FileReceiver file_receiver_;
+    QTimer file_part_timer_;
 
     Helpz::Network::WaiterMap wait_map;
     QVector<QPair<QUuid, QString>> lastUserDevices;
@@ -0,0 +1,220 @@
+#include <QDebug>
+#include <QSaveFile>
+#include <QtEndian>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+#include "outbox.h"
+
+namespace Dai {
+namespace Network {
+
+namespace {
+
+// payload size, seq, cmd
+const qint64 record_header_size = 4 + 8 + 2;
+
+// Compact copies the file by parts of this size
+const qint64 compact_chunk_size = 256 * 1024;
+
+} // namespace
+
+Outbox::Outbox(const QString &file_name, qint64 max_size) :
+    file_(file_name), ack_file_(file_name + ".ack"),
+    max_size_(std::max<qint64>(max_size, 1024 * 1024))
+{
+}
+
+Outbox::~Outbox()
+{
+    sync();
+}
+
+bool Outbox::open()
+{
+    if (!file_.open(QIODevice::ReadWrite) || !ack_file_.open(QIODevice::ReadWrite))
+    {
+        qWarning() << "Outbox: can't open" << file_.fileName() << file_.errorString() << ack_file_.errorString();
+        return false;
+    }
+
+    QByteArray acked = ack_file_.readAll();
+    if (acked.size() >= 8)
+        acked_seq_ = qFromLittleEndian<quint64>(reinterpret_cast<const uchar*>(acked.constData()));
+    last_seq_ = acked_seq_;
+
+    uchar header[record_header_size];
+    qint64 offset = 0;
+    while (file_.read(reinterpret_cast<char*>(header), record_header_size) == record_header_size)
+    {
+        Entry entry{ qFromLittleEndian<quint64>(header + 4), offset,
+                     qFromLittleEndian<quint32>(header), qFromLittleEndian<quint16>(header + 12) };
+        if (offset + record_header_size + entry.size > file_.size())
+            break;
+
+        if (entry.seq > acked_seq_)
+            entries_.push_back(entry);
+        last_seq_ = std::max(last_seq_, entry.seq);
+
+        offset += record_header_size + entry.size;
+        file_.seek(offset);
+    }
+
+    // Cut the record that wasn't written completely
+    if (offset != file_.size())
+    {
+        qWarning() << "Outbox: truncate broken tail" << file_.fileName() << offset << file_.size();
+        file_.resize(offset);
+    }
+
+    if (entries_.empty())
+        file_.resize(0);
+    return true;
+}
+
+quint64 Outbox::push(quint16 cmd, const QByteArray &data)
+{
+    const qint64 record_size = record_header_size + data.size();
+    if (file_.size() + record_size > max_size_ && !entries_.empty())
+    {
+        std::size_t dropped = 0;
+        qint64 free_size = 0;
+        while (dropped < entries_.size() && file_.size() - free_size + record_size > max_size_)
+            free_size = entries_.at(dropped++).offset + record_header_size + entries_.at(dropped - 1).size;
+
+        qWarning() << "Outbox: is full, drop oldest packs" << dropped;
+        ack(entries_.at(dropped - 1).seq);
+    }
+
+    Entry entry{ ++last_seq_, file_.size(), static_cast<quint32>(data.size()), cmd };
+
+    uchar header[record_header_size];
+    qToLittleEndian<quint32>(entry.size, header);
+    qToLittleEndian<quint64>(entry.seq, header + 4);
+    qToLittleEndian<quint16>(entry.cmd, header + 12);
+
+    if (!file_.seek(entry.offset) ||
+        file_.write(reinterpret_cast<const char*>(header), record_header_size) != record_header_size ||
+        file_.write(data) != data.size() ||
+        !file_.flush())
+    {
+        qWarning() << "Outbox: write failed" << file_.fileName() << file_.errorString();
+        file_.resize(entry.offset);
+        return 0;
+    }
+
+    entries_.push_back(entry);
+    unsynced_ = true;
+    return entry.seq;
+}
+
+void Outbox::sync()
+{
+    if (!unsynced_)
+        return;
+    unsynced_ = false;
+
+#ifdef Q_OS_UNIX
+    if (fsync(file_.handle()) != 0)
+        qWarning() << "Outbox: fsync failed" << file_.fileName();
+#endif
+}
+
+bool Outbox::next(quint16 *cmd, QByteArray *data, quint64 *seq)
+{
+    if (next_pos_ >= entries_.size())
+        return false;
+
+    const Entry& entry = entries_.at(next_pos_++);
+    if (!file_.seek(entry.offset + record_header_size))
+        return false;
+
+    *data = file_.read(entry.size);
+    *cmd = entry.cmd;
+    *seq = entry.seq;
+    return static_cast<quint32>(data->size()) == entry.size;
+}
+
+void Outbox::ack(quint64 seq)
+{
+    if (seq <= acked_seq_)
+        return;
+
+    std::size_t count = 0;
+    while (!entries_.empty() && entries_.front().seq <= seq)
+    {
+        entries_.pop_front();
+        ++count;
+    }
+    next_pos_ = next_pos_ > count ? next_pos_ - count : 0;
+
+    acked_seq_ = seq;
+    saveAcked();
+
+    if (entries_.empty())
+        file_.resize(0);
+    else if (entries_.front().offset > max_size_ / 4)
+        compact();
+}
+
+void Outbox::rewind() { next_pos_ = 0; }
+
+bool Outbox::hasUnsent() const { return next_pos_ < entries_.size(); }
+std::size_t Outbox::size() const { return entries_.size(); }
+
+void Outbox::saveAcked()
+{
+    uchar data[8];
+    qToLittleEndian<quint64>(acked_seq_, data);
+    if (!ack_file_.seek(0) || ack_file_.write(reinterpret_cast<const char*>(data), 8) != 8 || !ack_file_.flush())
+        qWarning() << "Outbox: can't save ack" << ack_file_.fileName() << ack_file_.errorString();
+}
+
+void Outbox::compact()
+{
+    const qint64 offset = entries_.front().offset;
+    const qint64 tail_size = file_.size() - offset;
+    const QString file_name = file_.fileName();
+
+    // Old file stays untouched until the new one is written completely
+    QSaveFile out(file_name);
+    out.setDirectWriteFallback(false);
+    if (!out.open(QIODevice::WriteOnly) || !file_.seek(offset))
+    {
+        qWarning() << "Outbox: compact failed" << file_name << out.errorString() << file_.errorString();
+        return;
+    }
+
+    qint64 copied = 0;
+    QByteArray chunk;
+    while (copied < tail_size)
+    {
+        chunk = file_.read(std::min(compact_chunk_size, tail_size - copied));
+        if (chunk.isEmpty() || out.write(chunk) != chunk.size())
+        {
+            qWarning() << "Outbox: compact failed" << file_name << out.errorString() << file_.errorString();
+            out.cancelWriting();
+            return;
+        }
+        copied += chunk.size();
+    }
+
+    file_.close();
+    const bool replaced = out.commit();
+    if (!file_.open(QIODevice::ReadWrite))
+        qWarning() << "Outbox: can't open" << file_name << file_.errorString();
+
+    if (!replaced)
+    {
+        qWarning() << "Outbox: can't replace" << file_name << out.errorString();
+        return;
+    }
+
+    for (Entry& entry: entries_)
+        entry.offset -= offset;
+}
+
+} // namespace Network
+} // namespace Dai
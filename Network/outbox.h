@@ -0,0 +1,65 @@
+#ifndef DAI_NETWORK_OUTBOX_H
+#define DAI_NETWORK_OUTBOX_H
+
+#include <deque>
+
+#include <QFile>
+
+namespace Dai {
+namespace Network {
+
+/**
+ * Очередь неотправленных на сервер пакетов на диске.
+ * Пакеты дописываются в конец файла с порядковым номером,
+ * после подтверждения сервером начало файла отбрасывается.
+ * В памяти хранятся только смещения записей, данные читаются из файла при отправке.
+ * push только передаёт запись системе, на диск её гарантированно пишет sync.
+ */
+class Outbox
+{
+public:
+    Outbox(const QString& file_name, qint64 max_size = 64 * 1024 * 1024);
+    ~Outbox();
+
+    bool open();
+
+    quint64 push(quint16 cmd, const QByteArray& data);
+
+    // fsync файла, если после прошлого вызова что-то записано
+    void sync();
+
+    // Следующий неотправленный пакет
+    bool next(quint16* cmd, QByteArray* data, quint64* seq);
+
+    // Все пакеты до seq включительно доставлены
+    void ack(quint64 seq);
+
+    // Начать отправку заново с первого неподтверждённого пакета
+    void rewind();
+
+    bool hasUnsent() const;
+    std::size_t size() const;
+private:
+    struct Entry {
+        quint64 seq;
+        qint64 offset;
+        quint32 size;
+        quint16 cmd;
+    };
+
+    void saveAcked();
+    void compact();
+
+    QFile file_, ack_file_;
+    qint64 max_size_;
+
+    quint64 last_seq_ = 0, acked_seq_ = 0;
+    bool unsynced_ = false;
+    std::deque<Entry> entries_;
+    std::size_t next_pos_ = 0;
+};
+
+} // namespace Network
+} // namespace Dai
+
+#endif // DAI_NETWORK_OUTBOX_H
@@ -0,0 +1,139 @@
+#ifndef DAI_NETWORK_PACK_LANE_H
+#define DAI_NETWORK_PACK_LANE_H
+
+#include <algorithm>
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QMutex>
+#include <QTimer>
+#include <QVector>
+
+namespace Dai {
+namespace Network {
+
+/**
+ * Очередь пакета на отправку с ограниченной задержкой.
+ * Таймер запускается первым элементом и не перезапускается следующими,
+ * поэтому элемент ждёт не дольше max_latency_ms.
+ * Пакет отправляется раньше, если превышено количество элементов или объём.
+ * При сплошном потоке событие таймера может запоздать, поэтому push проверяет возраст пакета сам.
+ */
+template<typename T>
+class PackLane
+{
+public:
+    struct Stats {
+        quint64 batches = 0;
+        quint64 items = 0;
+        int max_items = 0;
+        quint64 coalesced = 0;
+        qint64 bytes = 0;
+        qint64 age_ms = 0;
+        qint64 max_age_ms = 0;
+        int last_items = 0;
+        qint64 last_age_ms = 0;
+    };
+
+    PackLane(int max_latency_ms, int max_count, int max_bytes) :
+        max_latency_ms_(max_latency_ms), max_count_(max_count), max_bytes_(max_bytes), bytes_(0)
+    {
+        timer.setSingleShot(true);
+    }
+
+    // Возвращает true, если пакет пора отправлять
+    bool push(const T& item, int bytes)
+    {
+        if (items_.isEmpty())
+        {
+            age_.start();
+            timer.start(max_latency_ms_);
+        }
+
+        items_.push_back(item);
+        bytes_ += bytes;
+        return items_.size() >= max_count_ || bytes_ >= max_bytes_ || expired();
+    }
+
+    // Заменяет элемент с тем же ключом, если он уже есть в пакете
+    bool pushLatest(quint32 key, const T& item, int bytes)
+    {
+        auto it = latest_.find(key);
+        if (it == latest_.end())
+        {
+            latest_.insert(key, qMakePair(items_.size(), bytes));
+            return push(item, bytes);
+        }
+
+        items_[it->first] = item;
+        bytes_ += bytes - it->second;
+        it->second = bytes;
+
+        QMutexLocker lock(&mutex_);
+        ++stats_.coalesced;
+        return bytes_ >= max_bytes_ || expired();
+    }
+
+    bool isEmpty() const { return items_.isEmpty(); }
+
+    QVector<T> take()
+    {
+        timer.stop();
+        if (!items_.isEmpty())
+        {
+            QMutexLocker lock(&mutex_);
+            const qint64 age_ms = age_.elapsed();
+            ++stats_.batches;
+            stats_.items += items_.size();
+            stats_.max_items = std::max(stats_.max_items, items_.size());
+            stats_.bytes += bytes_;
+            stats_.age_ms += age_ms;
+            stats_.max_age_ms = std::max(stats_.max_age_ms, age_ms);
+            stats_.last_items = items_.size();
+            stats_.last_age_ms = age_ms;
+        }
+
+        bytes_ = 0;
+        latest_.clear();
+        QVector<T> items;
+        items.swap(items_);
+        return items;
+    }
+
+    QJsonObject stats() const
+    {
+        QMutexLocker lock(&mutex_);
+        QJsonObject obj;
+        obj["batches"] = static_cast<qint64>(stats_.batches);
+        obj["items"] = static_cast<qint64>(stats_.items);
+        obj["max_items"] = stats_.max_items;
+        obj["coalesced"] = static_cast<qint64>(stats_.coalesced);
+        obj["avg_items"] = stats_.batches ? double(stats_.items) / stats_.batches : 0.;
+        obj["bytes"] = stats_.bytes;
+        obj["avg_age_ms"] = stats_.batches ? double(stats_.age_ms) / stats_.batches : 0.;
+        obj["max_age_ms"] = stats_.max_age_ms;
+        obj["last_items"] = stats_.last_items;
+        obj["last_age_ms"] = stats_.last_age_ms;
+        return obj;
+    }
+
+    QTimer timer;
+private:
+    bool expired() const { return age_.elapsed() >= max_latency_ms_; }
+
+    int max_latency_ms_, max_count_, max_bytes_;
+
+    QVector<T> items_;
+    QHash<quint32, QPair<int, int>> latest_; // индекс, размер
+    int bytes_;
+    QElapsedTimer age_;
+
+    mutable QMutex mutex_;
+    Stats stats_;
+};
+
+} // namespace Network
+} // namespace Dai
+
+#endif // DAI_NETWORK_PACK_LANE_H
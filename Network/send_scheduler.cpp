@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <QJsonArray>
+
+#include "send_scheduler.h"
+
+namespace Dai {
+namespace Network {
+
+void TokenBucket::setRate(qint64 rate, qint64 burst)
+{
+    rate_ = std::max<qint64>(rate, 0);
+    burst_ = burst > 0 ? burst : rate_;
+    tokens_ = burst_;
+    last_ms_ = -1;
+}
+
+bool TokenBucket::isUnlimited() const { return rate_ == 0; }
+qint64 TokenBucket::rate() const { return rate_; }
+
+bool TokenBucket::canTake(qint64 now_ms)
+{
+    if (isUnlimited())
+        return true;
+
+    refill(now_ms);
+    if (tokens_ > 0)
+        return true;
+
+    ++throttled_;
+    return false;
+}
+
+void TokenBucket::take(qint64 bytes, qint64 now_ms)
+{
+    if (!isUnlimited())
+        tokens_ -= bytes;
+
+    if (now_ms - window_ms_ >= 1000)
+    {
+        throughput_ = window_bytes_ * 1000 / (now_ms - window_ms_);
+        window_ms_ = now_ms;
+        window_bytes_ = 0;
+    }
+    window_bytes_ += bytes;
+}
+
+qint64 TokenBucket::waitMs() const
+{
+    if (isUnlimited() || tokens_ > 0)
+        return 0;
+    return static_cast<qint64>(std::ceil(-tokens_ * 1000. / rate_)) + 1;
+}
+
+QJsonObject TokenBucket::stats(qint64 now_ms) const
+{
+    QJsonObject obj;
+    obj["rate"] = rate_;
+    obj["burst"] = burst_;
+    obj["tokens"] = isUnlimited() ? 0. : tokens_;
+    obj["throughput"] = now_ms - window_ms_ > 2000 ? 0 : throughput_;
+    obj["throttled"] = throttled_;
+    return obj;
+}
+
+void TokenBucket::refill(qint64 now_ms)
+{
+    if (last_ms_ >= 0)
+        tokens_ = std::min<double>(burst_, tokens_ + (now_ms - last_ms_) * rate_ / 1000.);
+    last_ms_ = now_ms;
+}
+
+// ------------------------------------------------------------------
+
+SendScheduler::SendScheduler(SendFunc send_func, int tick_ms, int tick_bytes, QObject *parent) :
+    QObject(parent),
+    send_func_(std::move(send_func)), tick_ms_(tick_ms), tick_bytes_(tick_bytes)
+{
+    clock_.start();
+    timer_.setSingleShot(true);
+    connect(&timer_, &QTimer::timeout, this, &SendScheduler::drain);
+}
+
+void SendScheduler::setLiveRate(qint64 rate, qint64 burst)
+{
+    QMutexLocker lock(&mutex_);
+    live_bucket_.setRate(rate, burst);
+}
+
+void SendScheduler::setHistoryRate(qint64 rate, qint64 burst)
+{
+    QMutexLocker lock(&mutex_);
+    history_bucket_.setRate(rate, burst);
+}
+
+void SendScheduler::push(Lane lane, quint16 cmd, const QByteArray &data, SentFunc on_sent)
+{
+    {
+        QMutexLocker lock(&mutex_);
+        LaneInfo& info = lanes_[lane];
+        info.queue.push_back(Message{cmd, data, clock_.elapsed(), std::move(on_sent)});
+        info.bytes += data.size();
+    }
+
+    // Send right away when the link is idle
+    if (!timer_.isActive())
+        drain();
+}
+
+qint64 SendScheduler::queuedBytes(Lane lane) const
+{
+    QMutexLocker lock(&mutex_);
+    return lanes_[lane].bytes;
+}
+
+void SendScheduler::setPaused(bool paused)
+{
+    for (LaneInfo& info: lanes_)
+        info.paused = paused;
+    if (!paused && !timer_.isActive())
+        drain();
+}
+
+void SendScheduler::setPaused(Lane lane, bool paused)
+{
+    lanes_[lane].paused = paused;
+    if (!paused && !timer_.isActive())
+        drain();
+}
+
+void SendScheduler::clear(Lane lane)
+{
+    QMutexLocker lock(&mutex_);
+    lanes_[lane].queue.clear();
+    lanes_[lane].bytes = 0;
+}
+
+QJsonObject SendScheduler::stats() const
+{
+    QMutexLocker lock(&mutex_);
+    QJsonArray lanes;
+    for (const LaneInfo& info: lanes_)
+    {
+        QJsonObject obj;
+        obj["queued"] = static_cast<int>(info.queue.size());
+        obj["queued_bytes"] = info.bytes;
+        obj["sent"] = static_cast<qint64>(info.sent);
+        obj["sent_bytes"] = info.sent_bytes;
+        obj["avg_wait_ms"] = info.sent ? double(info.wait_ms) / info.sent : 0.;
+        obj["max_wait_ms"] = info.max_wait_ms;
+        lanes.push_back(obj);
+    }
+
+    const qint64 now_ms = clock_.elapsed();
+    QJsonObject obj;
+    obj["lanes"] = lanes;
+    obj["live"] = live_bucket_.stats(now_ms);
+    obj["history"] = history_bucket_.stats(now_ms);
+    return obj;
+}
+
+int SendScheduler::tickBudget() const
+{
+    // Объём такта соответствует заданной скорости, без ограничения такт только
+    // возвращает управление циклу событий и сразу продолжается
+    QMutexLocker lock(&mutex_);
+    const qint64 rate = std::max(live_bucket_.rate(), history_bucket_.rate());
+    if (live_bucket_.isUnlimited() || history_bucket_.isUnlimited() || rate * tick_ms_ / 1000 < tick_bytes_)
+        return tick_bytes_;
+    return static_cast<int>(std::min<qint64>(rate * tick_ms_ / 1000, std::numeric_limits<int>::max()));
+}
+
+void SendScheduler::drain()
+{
+    const qint64 now_ms = clock_.elapsed();
+    int budget = tickBudget();
+    qint64 next_ms = -1;
+    auto retryAfter = [&next_ms](qint64 ms) { next_ms = next_ms < 0 ? ms : std::min(next_ms, ms); };
+
+    for (int lane = 0; lane < LaneCount; ++lane)
+    {
+        LaneInfo& info = lanes_[lane];
+        TokenBucket& bucket = lane == BulkLane ? history_bucket_ : live_bucket_;
+        if (info.paused)
+            continue;
+
+        while (!info.queue.empty())
+        {
+            if (budget <= 0)
+            {
+                retryAfter(0);
+                break;
+            }
+
+            {
+                QMutexLocker lock(&mutex_);
+                if (!bucket.canTake(now_ms))
+                {
+                    retryAfter(bucket.waitMs());
+                    break;
+                }
+            }
+
+            // Сообщение снимается с очереди только после записи в соединение
+            const quint16 cmd = info.queue.front().cmd;
+            const QByteArray data = info.queue.front().data;
+            if (!send_func_(cmd, data))
+            {
+                // Соединения нет: сообщение остаётся первым, очередь ждёт снятия паузы
+                info.paused = true;
+                return;
+            }
+
+            Message msg;
+            {
+                QMutexLocker lock(&mutex_);
+                msg = std::move(info.queue.front());
+                info.queue.pop_front();
+                info.bytes -= msg.data.size();
+                bucket.take(msg.data.size(), now_ms);
+
+                const qint64 wait_ms = now_ms - msg.queued_ms;
+                ++info.sent;
+                info.sent_bytes += msg.data.size();
+                info.wait_ms += wait_ms;
+                info.max_wait_ms = std::max(info.max_wait_ms, wait_ms);
+            }
+
+            budget -= msg.data.size();
+            if (msg.on_sent)
+                msg.on_sent();
+        }
+    }
+
+    if (next_ms >= 0)
+        timer_.start(static_cast<int>(next_ms));
+}
+
+} // namespace Network
+} // namespace Dai
@@ -0,0 +1,132 @@
+#ifndef DAI_NETWORK_SEND_SCHEDULER_H
+#define DAI_NETWORK_SEND_SCHEDULER_H
+
+#include <deque>
+#include <functional>
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+
+namespace Dai {
+namespace Network {
+
+/**
+ * Ограничение скорости "ведро с жетонами".
+ * Жетоны (байты) набираются со скоростью rate до объёма burst.
+ * Сообщение уходит, если ведро не пустое, поэтому большое сообщение
+ * может увести его в минус, и следующие будут ждать дольше.
+ * За любое время T уходит не больше burst + rate * T байт плюс одно сообщение.
+ */
+class TokenBucket
+{
+public:
+    void setRate(qint64 rate, qint64 burst);
+    bool isUnlimited() const;
+    qint64 rate() const;
+
+    bool canTake(qint64 now_ms);
+    void take(qint64 bytes, qint64 now_ms);
+
+    // Через сколько мс ведро станет не пустым
+    qint64 waitMs() const;
+
+    QJsonObject stats(qint64 now_ms) const;
+private:
+    void refill(qint64 now_ms);
+
+    qint64 rate_ = 0, burst_ = 0; // байт/с, байт
+    double tokens_ = 0;
+    qint64 last_ms_ = 0;
+
+    // Фактическая скорость за последнюю секунду
+    qint64 window_ms_ = 0, window_bytes_ = 0, throughput_ = 0;
+    qint64 throttled_ = 0;
+};
+
+/**
+ * Очередь отправки с приоритетами.
+ * Сообщения из более приоритетной очереди всегда уходят первыми,
+ * за один такт отправляется не больше объёма такта (по заданной скорости,
+ * но не меньше tick_bytes), после чего управление возвращается циклу событий,
+ * поэтому большой поток истории не задерживает статусы и аварии.
+ * У истории и живых данных свои ограничения скорости.
+ * Если сообщение не удалось записать, оно остаётся в очереди, а очередь встаёт на паузу.
+ * Внутри очереди порядок сохраняется. Менее приоритетная очередь отправляет, только если
+ * более приоритетные пусты, на паузе или упёрлись в своё ведро (у истории ведро своё).
+ */
+class SendScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    enum Lane : int {
+        StatusLane = 0, // статусы, режимы, аварии
+        ControlLane,    // ответы на команды сервера
+        TelemetryLane,  // пакеты значений и событий
+        BulkLane,       // история и структура
+
+        LaneCount
+    };
+
+    // false, если сообщение не записано в соединение
+    typedef std::function<bool(quint16 cmd, const QByteArray& data)> SendFunc;
+    typedef std::function<void()> SentFunc;
+
+    SendScheduler(SendFunc send_func, int tick_ms = 10, int tick_bytes = 16 * 1024, QObject* parent = nullptr);
+
+    // rate в байт/с, 0 - без ограничения
+    void setLiveRate(qint64 rate, qint64 burst);
+    void setHistoryRate(qint64 rate, qint64 burst);
+
+    // on_sent вызывается после записи сообщения в соединение, при clear() не вызывается
+    void push(Lane lane, quint16 cmd, const QByteArray& data, SentFunc on_sent = SentFunc());
+
+    qint64 queuedBytes(Lane lane) const;
+
+    // Пока стоит пауза, сообщения только накапливаются
+    void setPaused(bool paused);
+    void setPaused(Lane lane, bool paused);
+    void clear(Lane lane);
+
+    // Thread-safe
+    QJsonObject stats() const;
+private slots:
+    void drain();
+private:
+    int tickBudget() const;
+
+    struct Message {
+        quint16 cmd;
+        QByteArray data;
+        qint64 queued_ms;
+        SentFunc on_sent;
+    };
+
+    struct LaneInfo {
+        std::deque<Message> queue;
+        qint64 bytes = 0;
+        bool paused = false;
+
+        quint64 sent = 0;
+        qint64 sent_bytes = 0;
+        qint64 wait_ms = 0;
+        qint64 max_wait_ms = 0;
+    };
+
+    SendFunc send_func_;
+    int tick_ms_, tick_bytes_;
+
+    QTimer timer_;
+    QElapsedTimer clock_;
+
+    mutable QMutex mutex_;
+    LaneInfo lanes_[LaneCount];
+    TokenBucket live_bucket_, history_bucket_;
+};
+
+} // namespace Network
+} // namespace Dai
+
+#endif // DAI_NETWORK_SEND_SCHEDULER_H
@@ -0,0 +1,63 @@
+#include <QCryptographicHash>
+#include <QDataStream>
+
+#include <Dai/project.h>
+
+#include "structure_hash.h"
+
+namespace Dai {
+namespace Network {
+
+namespace {
+
+// Хэш того же потока, что уходит на сервер в полной структуре
+template<typename T>
+QByteArray hashOf(const T& value)
+{
+    QByteArray data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_5_7);
+    ds << value;
+    return QCryptographicHash::hash(data, QCryptographicHash::Md5);
+}
+
+template<typename T>
+QByteArray itemHashes(const QVector<T*>& items, StructureHash::ItemHashes* hashes)
+{
+    QCryptographicHash part_hash(QCryptographicHash::Md5);
+    for (T* item: items)
+    {
+        QByteArray hash = hashOf(QVector<T*>{item});
+        part_hash.addData(hash);
+        hashes->push_back(qMakePair(item->id(), hash));
+    }
+    return part_hash.result();
+}
+
+} // namespace
+
+StructureHash StructureHash::build(Project *prj)
+{
+    StructureHash res;
+    res.parts = {
+        { pItemTypes,   hashOf(prj->ItemTypeMng) },
+        { pGroupTypes,  hashOf(prj->GroupTypeMng) },
+        { pModeTypes,   hashOf(prj->ModeTypeMng) },
+        { pSigns,       hashOf(prj->SignMng) },
+        { pStatusTypes, hashOf(prj->StatusTypeMng) },
+        { pStatuses,    hashOf(prj->StatusMng) },
+        { pParams,      hashOf(prj->ParamMng) },
+        { pCodes,       hashOf(prj->get_codes_checksum()) },
+        { pSections,    itemHashes(prj->sections(), &res.sections) },
+        { pDevices,     itemHashes(prj->devices(), &res.devices) },
+    };
+
+    QCryptographicHash root_hash(QCryptographicHash::Md5);
+    for (const auto& part: res.parts)
+        root_hash.addData(part.second);
+    res.root = root_hash.result();
+    return res;
+}
+
+} // namespace Network
+} // namespace Dai
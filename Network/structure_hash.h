@@ -0,0 +1,56 @@
+#ifndef DAI_NETWORK_STRUCTURE_HASH_H
+#define DAI_NETWORK_STRUCTURE_HASH_H
+
+#include <QVector>
+#include <QPair>
+
+namespace Dai {
+
+class Project;
+
+namespace Network {
+
+/**
+ * Дерево контрольных сумм структуры проекта.
+ * Корень - сумма по частям, у секций и устройств есть суммы по каждому элементу.
+ * Сервер сравнивает суммы и запрашивает только отличающиеся части.
+ *
+ * Сервер считает суммы сам, поэтому формат фиксирован:
+ *  - часть: MD5 от QDataStream (Qt_5_7) менеджера части, как он уходит в полной структуре,
+ *    для pCodes - от контрольной суммы кодов;
+ *  - секция/устройство: MD5 от QDataStream (Qt_5_7) QVector из одного элемента;
+ *  - pSections/pDevices: MD5 от склеенных 16-байтных сумм элементов в порядке проекта;
+ *  - root: MD5 от склеенных сумм частей в порядке Part.
+ * Любое изменение сериализации структуры меняет суммы, и сервер запросит её целиком.
+ */
+struct StructureHash
+{
+    enum Part : quint8 {
+        pItemTypes = 1,
+        pGroupTypes,
+        pModeTypes,
+        pSigns,
+        pStatusTypes,
+        pStatuses,
+        pParams,
+        pCodes,
+        pSections,
+        pDevices,
+    };
+
+    typedef QVector<QPair<quint32, QByteArray>> ItemHashes;
+
+    QByteArray root;
+    QVector<QPair<quint8, QByteArray>> parts;
+    ItemHashes sections, devices;
+
+    bool isEmpty() const { return root.isEmpty(); }
+    void clear() { *this = StructureHash(); }
+
+    static StructureHash build(Project* prj);
+};
+
+} // namespace Network
+} // namespace Dai
+
+#endif // DAI_NETWORK_STRUCTURE_HASH_H
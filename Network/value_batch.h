@@ -0,0 +1,45 @@
+#ifndef DAI_NETWORK_VALUE_BATCH_H
+#define DAI_NETWORK_VALUE_BATCH_H
+
+#include <memory>
+
+#include <QMetaType>
+#include <QVector>
+
+#include <Dai/logpack.h>
+
+namespace Dai {
+
+/**
+ * Новые значения за один такт.
+ * Создаётся один раз и дальше не меняется, поэтому без копирования
+ * передаётся во все потоки: клиентам серверов и WebSocket.
+ * Общие у них только значения: клиент кодирует свои пакеты для dai/1.2,
+ * а WebSocket шлёт кадры в формате библиотеки.
+ */
+class ValueBatch
+{
+public:
+    enum Flags : quint8 {
+        Immediately     = 0x01,
+        Coalesce        = 0x02, // [RemoteServer] CoalesceItemTypes
+        WebSockCoalesce = 0x04, // [WebSocket] CoalesceItemTypes
+    };
+
+    ValueBatch(QVector<ValuePackItem> items, QVector<quint8> flags) :
+        items_(std::move(items)), flags_(std::move(flags)) {}
+
+    const QVector<ValuePackItem>& items() const { return items_; }
+    const QVector<quint8>& flags() const { return flags_; }
+private:
+    QVector<ValuePackItem> items_;
+    QVector<quint8> flags_;
+};
+
+typedef std::shared_ptr<const ValueBatch> ValueBatchPtr;
+
+} // namespace Dai
+
+Q_DECLARE_METATYPE(Dai::ValueBatchPtr)
+
+#endif // DAI_NETWORK_VALUE_BATCH_H
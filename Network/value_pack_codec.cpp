@@ -0,0 +1,267 @@
+#include <cmath>
+#include <cstring>
+
+#include <QDataStream>
+#include <QMetaType>
+#include <QtEndian>
+
+#include "Database/bit_stream.h"
+#include "value_pack_codec.h"
+
+namespace Dai {
+namespace Network {
+namespace ValuePackCodec {
+
+namespace {
+
+enum Flags : quint8 {
+    fCompressed = 0x01,
+};
+
+enum ValueTag : quint8 {
+    tInvalid = 0,
+    tFalse,
+    tTrue,
+    tInt,
+    tUInt,
+    tLongLong,
+    tULongLong,
+    tDouble,
+    tIntegralDouble,
+    tVariant,
+};
+
+// Меньше этого размера сжатие не окупается
+const int compress_threshold = 256;
+
+bool writeValue(QByteArray& data, const QVariant& value)
+{
+    switch (value.type()) {
+    case QVariant::Invalid:
+        data.append(static_cast<char>(tInvalid));
+        break;
+    case QVariant::Bool:
+        data.append(static_cast<char>(value.toBool() ? tTrue : tFalse));
+        break;
+    case QVariant::Int:
+        data.append(static_cast<char>(tInt));
+        writeVarint(data, zigzagEncode(value.toInt()));
+        break;
+    case QVariant::UInt:
+        data.append(static_cast<char>(tUInt));
+        writeVarint(data, value.toUInt());
+        break;
+    case QVariant::LongLong:
+        data.append(static_cast<char>(tLongLong));
+        writeVarint(data, zigzagEncode(value.toLongLong()));
+        break;
+    case QVariant::ULongLong:
+        data.append(static_cast<char>(tULongLong));
+        writeVarint(data, value.toULongLong());
+        break;
+    case QVariant::Double: {
+        const double number = value.toDouble();
+        // -0.0 goes as double, integral form would lose the sign
+        if (std::floor(number) == number && std::fabs(number) < 9007199254740992. && // 2^53
+            !(number == 0. && std::signbit(number)))
+        {
+            data.append(static_cast<char>(tIntegralDouble));
+            writeVarint(data, zigzagEncode(static_cast<qint64>(number)));
+        }
+        else
+        {
+            uchar bytes[8];
+            quint64 bits;
+            memcpy(&bits, &number, sizeof(bits));
+            qToLittleEndian<quint64>(bits, bytes);
+            data.append(static_cast<char>(tDouble));
+            data.append(reinterpret_cast<const char*>(bytes), 8);
+        }
+        break;
+    }
+    default: {
+        // QVariant::save only warns about a type without stream operators, so it is checked first
+        {
+            QByteArray probe;
+            QDataStream ds(&probe, QIODevice::WriteOnly);
+            ds.setVersion(QDataStream::Qt_5_7);
+            if (!QMetaType::save(ds, value.userType(), value.constData()))
+                return false;
+        }
+
+        QByteArray variant_data;
+        QDataStream ds(&variant_data, QIODevice::WriteOnly);
+        ds.setVersion(QDataStream::Qt_5_7);
+        ds << value;
+        if (ds.status() != QDataStream::Ok)
+            return false;
+
+        data.append(static_cast<char>(tVariant));
+        writeVarint(data, variant_data.size());
+        data.append(variant_data);
+        break;
+    }
+    }
+    return true;
+}
+
+bool readValue(const QByteArray& data, int& pos, QVariant& value)
+{
+    if (pos >= data.size())
+        return false;
+
+    quint64 number;
+    switch (static_cast<quint8>(data.at(pos++))) {
+    case tInvalid:  value = QVariant(); return true;
+    case tFalse:    value = false; return true;
+    case tTrue:     value = true; return true;
+    case tInt:
+        if (!readVarint(data, pos, number)) return false;
+        value = static_cast<int>(zigzagDecode(number));
+        return true;
+    case tUInt:
+        if (!readVarint(data, pos, number)) return false;
+        value = static_cast<uint>(number);
+        return true;
+    case tLongLong:
+        if (!readVarint(data, pos, number)) return false;
+        value = zigzagDecode(number);
+        return true;
+    case tULongLong:
+        if (!readVarint(data, pos, number)) return false;
+        value = number;
+        return true;
+    case tIntegralDouble:
+        if (!readVarint(data, pos, number)) return false;
+        value = static_cast<double>(zigzagDecode(number));
+        return true;
+    case tDouble: {
+        if (pos + 8 > data.size())
+            return false;
+        quint64 bits = qFromLittleEndian<quint64>(reinterpret_cast<const uchar*>(data.constData() + pos));
+        double real;
+        memcpy(&real, &bits, sizeof(real));
+        value = real;
+        pos += 8;
+        return true;
+    }
+    case tVariant: {
+        if (!readVarint(data, pos, number) || pos + static_cast<qint64>(number) > data.size())
+            return false;
+        QDataStream ds(QByteArray::fromRawData(data.constData() + pos, static_cast<int>(number)));
+        ds.setVersion(QDataStream::Qt_5_7);
+        ds >> value;
+        pos += static_cast<int>(number);
+        return ds.status() == QDataStream::Ok;
+    }
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+QByteArray encode(const QVector<ValuePackItem> &pack, bool allow_compress)
+{
+    QByteArray body;
+    writeVarint(body, pack.size());
+
+    qint64 prev = 0;
+    for (const ValuePackItem& item: pack)
+    {
+        writeVarint(body, zigzagEncode(static_cast<qint64>(item.id) - prev));
+        prev = item.id;
+    }
+
+    prev = 0;
+    for (const ValuePackItem& item: pack)
+    {
+        writeVarint(body, zigzagEncode(static_cast<qint64>(item.item_id) - prev));
+        prev = item.item_id;
+    }
+
+    // Дельты считаются с переполнением по модулю 2^64, чтобы любое время раскодировалось обратно
+    quint64 prev_time = 0, prev_delta = 0;
+    for (const ValuePackItem& item: pack)
+    {
+        const quint64 delta = static_cast<quint64>(item.time_msecs) - prev_time;
+        writeVarint(body, zigzagEncode(static_cast<qint64>(delta - prev_delta)));
+        prev_delta = delta;
+        prev_time = static_cast<quint64>(item.time_msecs);
+    }
+
+    for (const ValuePackItem& item: pack)
+        if (!writeValue(body, item.raw_value))
+            return {};
+    for (const ValuePackItem& item: pack)
+        if (!writeValue(body, item.value))
+            return {};
+
+    quint8 flags = 0;
+    if (allow_compress && body.size() >= compress_threshold)
+    {
+        QByteArray compressed = qCompress(body);
+        if (compressed.size() < body.size())
+        {
+            body = std::move(compressed);
+            flags |= fCompressed;
+        }
+    }
+
+    body.prepend(static_cast<char>(flags));
+    return body;
+}
+
+bool decode(const QByteArray &data, QVector<ValuePackItem> *pack)
+{
+    if (data.isEmpty())
+        return false;
+
+    const quint8 flags = static_cast<quint8>(data.at(0));
+    const QByteArray body = flags & fCompressed ? qUncompress(data.mid(1)) : data.mid(1);
+
+    int pos = 0;
+    quint64 count, number;
+    if (!readVarint(body, pos, count) || count > static_cast<quint64>(body.size()))
+        return false;
+
+    pack->resize(static_cast<int>(count));
+
+    qint64 prev = 0;
+    for (ValuePackItem& item: *pack)
+    {
+        if (!readVarint(body, pos, number)) return false;
+        prev += zigzagDecode(number);
+        item.id = static_cast<quint32>(prev);
+    }
+
+    prev = 0;
+    for (ValuePackItem& item: *pack)
+    {
+        if (!readVarint(body, pos, number)) return false;
+        prev += zigzagDecode(number);
+        item.item_id = static_cast<quint32>(prev);
+    }
+
+    quint64 time = 0, delta = 0;
+    for (ValuePackItem& item: *pack)
+    {
+        if (!readVarint(body, pos, number)) return false;
+        delta += static_cast<quint64>(zigzagDecode(number));
+        time += delta;
+        item.time_msecs = static_cast<qint64>(time);
+    }
+
+    for (ValuePackItem& item: *pack)
+        if (!readValue(body, pos, item.raw_value))
+            return false;
+    for (ValuePackItem& item: *pack)
+        if (!readValue(body, pos, item.value))
+            return false;
+
+    return pos == body.size();
+}
+
+} // namespace ValuePackCodec
+} // namespace Network
+} // namespace Dai
@@ -0,0 +1,27 @@
+#ifndef DAI_NETWORK_VALUE_PACK_CODEC_H
+#define DAI_NETWORK_VALUE_PACK_CODEC_H
+
+#include <QVector>
+
+#include <Dai/logpack.h>
+
+namespace Dai {
+namespace Network {
+
+/**
+ * Компактная кодировка пакета значений для протокола dai/1.2.
+ * Поля пишутся колонками: id и item_id - дельты, время - дельта от дельты,
+ * значения - тег типа и значение без лишних байт.
+ * Если пакет большой, он сжимается zlib.
+ */
+namespace ValuePackCodec {
+
+// Пустой результат - в пакете есть значение, тип которого нельзя записать в QDataStream
+QByteArray encode(const QVector<ValuePackItem>& pack, bool allow_compress = true);
+bool decode(const QByteArray& data, QVector<ValuePackItem>* pack);
+
+} // namespace ValuePackCodec
+} // namespace Network
+} // namespace Dai
+
+#endif // DAI_NETWORK_VALUE_PACK_CODEC_H
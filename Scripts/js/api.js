@@ -1,3 +1,5 @@
+// Секции, группы и элементы приходят в функции скрипта одними и теми же объектами:
+// добавленные им свойства сохраняются между вызовами до перезагрузки проекта
 var api = {
     actDevice: function(sct, type, newState) {
         sct.setControlState(type, newState, api.type.mode.automatic)
@@ -11,6 +13,12 @@ var api = {
         }
         return null;
     },
+    subscribe: function(groupType, itemTypes, handler) {
+        api.mng.subscribe(groupType, itemTypes, handler);
+    },
+    profile: function(top) {
+        return JSON.parse(api.mng.profile(top !== undefined ? top : 10));
+    },
     status: {},
     type: {
         item: {}, group: {}, mode: {}, param: {}
@@ -1,5 +1,8 @@
+#include <set>
+
 #include <QTimer>
 #include <QElapsedTimer>
+#include <QPointer>
 
 #include <QFile>
 #include <QTextStream>
@@ -7,10 +10,12 @@
 #include <QDebug>
 #include <QMetaEnum>
 #include <QProcess>
+#include <QJsonDocument>
 
 #include <Helpz/consolereader.h>
 
 #include "scriptedproject.h"
+#include "scriptengine.h"
 #include "paramgroupclass.h"
 
 #include "tools/automationhelper.h"
@@ -84,9 +89,10 @@ void ScriptedProject::addType()
 //    qCDebug(ProjectLog) << "Register for script:" << name;
 }
 
-ScriptedProject::ScriptedProject(Worker* worker, Helpz::ConsoleReader *consoleReader, const QString &sshHost, bool allow_shell) :
+ScriptedProject::ScriptedProject(Worker* worker, Helpz::ConsoleReader *consoleReader, const QString &sshHost, bool allow_shell, int tick_ms,
+                                 int call_budget_ms, int max_aborts) :
     Project(), //(worker->database()->clone<DBManager>("ScriptSql")),
-    m_func(fAutomation), m_dayTime(this),
+    m_func(fAutomation), m_call_budget_ms(call_budget_ms), m_max_aborts(max_aborts), m_tick_ms(tick_ms), m_dayTime(this),
     m_uptime(QDateTime::currentMSecsSinceEpoch()),
     ssh_host(sshHost), allow_shell_(allow_shell)
 {
@@ -96,6 +102,22 @@ ScriptedProject::ScriptedProject(Worker* worker, Helpz::ConsoleReader *consoleRe
 //    db()->setTypeManager(this);
     registerTypes();
 
+    m_tick_timer.setSingleShot(true);
+    connect(&m_tick_timer, &QTimer::timeout, this, &ScriptedProject::changedItemsTick);
+
+    if (m_call_budget_ms > 0)
+    {
+        // abortEvaluation можно вызвать только из потока движка, поэтому
+        // движок сам обрабатывает события во время долгого вызова,
+        // и таймер сторожа срабатывает прямо посреди скрипта.
+        // События обрабатываются раз в m_call_budget_ms, так что прерывание
+        // случается через время от одного до двух бюджетов.
+        // Слоты, которые снова вызвали бы скрипт, при этом откладываются, см. defer
+        eng->setProcessEventsInterval(m_call_budget_ms);
+        m_watchdog.setSingleShot(true);
+        connect(&m_watchdog, &QTimer::timeout, this, &ScriptedProject::callTimeout);
+    }
+
     eng->pushContext();
     reinitialization(worker->database_info());
 
@@ -117,6 +139,10 @@ ScriptedProject::ScriptedProject(Worker* worker, Helpz::ConsoleReader *consoleRe
 
 ScriptedProject::~ScriptedProject()
 {
+    // Секции и группы удаляются уже после m_wrappers
+    for (auto& it: m_wrappers)
+        disconnect(it.first, &QObject::destroyed, this, nullptr);
+
 //    delete db();
 }
 
@@ -126,11 +152,26 @@ qint64 ScriptedProject::uptime() const { return m_uptime; }
 
 void ScriptedProject::reinitialization(const Helpz::Database::ConnectionInfo& db_info)
 {
+    // popContext посреди выполнения скрипта сломает движок
+    if (defer([this, db_info]() { reinitialization(db_info); }))
+        return;
+
+    m_wrappers.clear();
+    m_tick_timer.stop();
+    m_changed_items.clear();
+    m_subscriptions.clear();
+    m_subscribers.clear();
+
     eng->popContext();
     QScriptContext* ctx = eng->pushContext();
     QScriptValue obj = ctx->activationObject();
 
     m_func.resize(fAutomation);
+    m_func_names.clear();
+    m_aborts.clear();
+    m_disabled.clear();
+    m_handler_aborts.clear();
+    m_disabled_handlers.clear();
 
     std::unique_ptr<Database> db(new Database(db_info, "ProjectManager_" + QString::number((quintptr)this)));
     db->fillTypes(this);
@@ -153,9 +194,8 @@ void ScriptedProject::reinitialization(const Helpz::Database::ConnectionInfo& db
     m_func[fGroupStatus] = obj.property("groupStatus");
 
     m_dayTime.stop();
-    qScriptDisconnect(&m_dayTime, SIGNAL(onDayPartChanged(Section*,bool)), QScriptValue(), QScriptValue());
     m_dayTime.disconnect(SIGNAL(onDayPartChanged(Section*,bool)));
-    qScriptConnect(&m_dayTime, SIGNAL(onDayPartChanged(Section*,bool)), QScriptValue(), m_func.at(fDayPartChanged));
+    connect(&m_dayTime, &DayTimeHelper::onDayPartChanged, this, &ScriptedProject::dayPartChanged);
 
     db->initProject(this, true);
 
@@ -197,6 +237,7 @@ void ScriptedProject::registerTypes()
     qRegisterMetaType<AutomationHelper*>("AutomationHelper*");
 
     eng = new QScriptEngine(this);
+    m_engine.reset(new QScriptBackend(eng));
     connect(eng, &QScriptEngine::signalHandlerException,
             this, &ScriptedProject::handlerException);
 
@@ -264,24 +305,24 @@ void initTypes(QScriptValue& parent, const QString& prop_name, BaseTypeManager<T
     }
 }
 
-void ScriptedProject::scriptsInitialization()
+static QString readScriptFile(const QString& fileBase)
 {
-    auto readScriptFile = [](const QString& fileBase) -> QString
-    {
-        QString content;
+    QString content;
 
-        QFile scriptFile(":/Scripts/js/" + fileBase + ".js");
-        if (scriptFile.exists())
-        {
-            scriptFile.open(QIODevice::ReadOnly | QFile::Text);
-            QTextStream stream(&scriptFile);
-            content = stream.readAll();
-            scriptFile.close();
-        }
+    QFile scriptFile(":/Scripts/js/" + fileBase + ".js");
+    if (scriptFile.exists())
+    {
+        scriptFile.open(QIODevice::ReadOnly | QFile::Text);
+        QTextStream stream(&scriptFile);
+        content = stream.readAll();
+        scriptFile.close();
+    }
 
-        return content;
-    };
+    return content;
+}
 
+void ScriptedProject::scriptsInitialization()
+{
     check_error( "API", readScriptFile("api") );
 
     QScriptValue api = eng->currentContext()->activationObject().property("api");
@@ -388,10 +429,19 @@ Section *ScriptedProject::addSection(quint32 id, const QString &name, const Time
 //    connect(sct, SIGNAL(itemChanged(DeviceItem*)), SIGNAL(sctItemChanged(DeviceItem*)));
 //    connect(sct, &Section::autoChanged, [this](uint type, bool isAuto) { });
 
-    callFunction(fInitSection, { eng->newQObject(sct) });
+    callFunction(fInitSection, { wrap(sct) });
     return sct;
 }
 
+const ScriptProfiler &ScriptedProject::profiler() const { return m_profiler; }
+
+QString ScriptedProject::profile(int top) const
+{
+    return QJsonDocument(m_profiler.stats(top)).toJson(QJsonDocument::Compact);
+}
+
+void ScriptedProject::profileReset() { m_profiler.reset(); }
+
 QScriptValue ScriptedProject::valueFromVariant(const QVariant &data) const
 {
     switch (data.type()) {
@@ -427,10 +477,15 @@ void ScriptedProject::log(const QString &msg, uint type)
 
 void ScriptedProject::console(const QString &cmd)
 {
+    if (defer([this, cmd]() { console(cmd); }))
+        return;
+
     QString script = cmd.trimmed();
     if (script.isEmpty() || !eng->canEvaluate(script))
         return;
 
+    // Команда консоли выполняется без сторожа, но события посреди неё тоже откладываются
+    ++m_call_depth;
     auto res = eng->evaluate(script, "CONSOLE");
     bool is_error = res.isError();
 
@@ -454,6 +509,8 @@ void ScriptedProject::console(const QString &cmd)
         }
     }
 
+    endCall();
+
     (is_error ? qCritical(ScriptLog) : qInfo(ScriptLog)).noquote() << "CONSOLE ["<< script << "] >" << res.toString();
 }
 
@@ -473,21 +530,142 @@ QScriptValue ScriptedProject::callFunction(uint func_idx, const QScriptValueList
     if (func_idx < m_func.size())
     {
         auto func = m_func.at(func_idx);
-        if (func.isFunction())
+        if (func.isFunction() && !m_disabled.count(func_idx))
         {
-            QScriptValue ret = func.call(QScriptValue(), args);
-            check_error( func.property("name").toString(), ret);
+            bool aborted;
+            QScriptValue ret = call(func, args, functionName(func_idx), &aborted);
+            if (aborted)
+            {
+                if (abortedCall(m_aborts[func_idx], functionName(func_idx)))
+                    m_disabled.insert(func_idx);
+            }
+            else if (!m_aborts.empty())
+                m_aborts.erase(func_idx);
             return ret;
         }
     }
     return QScriptValue();
 }
 
-void ScriptedProject::run_automation(ItemGroup* group, const QScriptValue& groupObj, const QScriptValue &itemObj)
+QScriptValue ScriptedProject::call(QScriptValue func, const QScriptValueList &args, const QString &name, bool *aborted) const
+{
+    // Вложенные вызовы идут в счёт внешнего
+    const bool watch = m_call_depth++ == 0 && m_call_budget_ms > 0;
+    if (watch)
+    {
+        m_call_aborted = false;
+        m_watchdog.start(m_call_budget_ms);
+    }
+
+    QScriptValue ret;
+    {
+        ScriptProfiler::Scope scope(&m_profiler, name);
+        ret = func.call(QScriptValue(), args);
+    }
+
+    endCall();
+    if (watch)
+    {
+        m_watchdog.stop();
+        if (m_call_aborted)
+            m_profiler.addAbort(name);
+    }
+    if (aborted)
+        *aborted = watch && m_call_aborted;
+
+    check_error(name, ret);
+    return ret;
+}
+
+bool ScriptedProject::abortedCall(int& count, const QString& name) const
+{
+    qCWarning(ScriptLog) << "Script function" << name << "aborted after" << m_call_budget_ms << "ms, times in a row:" << ++count;
+
+    if (count < m_max_aborts)
+        return false;
+    qCCritical(ScriptLog) << "Script function" << name << "disabled, it keeps exceeding" << m_call_budget_ms << "ms";
+    return true;
+}
+
+void ScriptedProject::endCall() const
+{
+    if (--m_call_depth == 0 && !m_deferred.empty())
+        QMetaObject::invokeMethod(const_cast<ScriptedProject*>(this), "runDeferred", Qt::QueuedConnection);
+}
+
+bool ScriptedProject::defer(std::function<void()> func)
+{
+    // Отложенные уже стоят в очереди, новое событие идёт за ними
+    if (m_call_depth == 0 && (m_deferred.empty() || m_running_deferred))
+        return false;
+
+    m_deferred.push_back(std::move(func));
+    return true;
+}
+
+void ScriptedProject::runDeferred()
+{
+    while (!m_deferred.empty() && m_call_depth == 0)
+    {
+        std::function<void()> func = std::move(m_deferred.front());
+        m_deferred.pop_front();
+
+        m_running_deferred = true;
+        func();
+        m_running_deferred = false;
+    }
+}
+
+void ScriptedProject::callTimeout()
+{
+    if (m_call_depth > 0 && eng->isEvaluating())
+    {
+        m_call_aborted = true;
+        m_engine->interrupt();
+    }
+}
+
+const QString &ScriptedProject::functionName(uint func_idx) const
+{
+    if (m_func_names.size() != m_func.size())
+        m_func_names.resize(m_func.size());
+
+    QString& name = m_func_names[func_idx];
+    if (name.isEmpty())
+    {
+        if (func_idx < fAutomation)
+            name = QMetaEnum::fromType<ScriptFunction>().valueToKey(static_cast<ScriptFunction>(func_idx));
+        else
+            name = m_func.at(func_idx).property("name").toString();
+
+        if (name.isEmpty())
+            name = QString::number(func_idx);
+    }
+    return name;
+}
+
+QScriptValue ScriptedProject::wrap(QObject *obj) const
+{
+    auto it = m_wrappers.find(obj);
+    if (it != m_wrappers.cend())
+        return it->second;
+
+    QScriptValue value = eng->newQObject(obj);
+    m_wrappers.emplace(obj, value);
+    connect(obj, &QObject::destroyed, this, [this](QObject* obj) { m_wrappers.erase(obj); });
+    return value;
+}
+
+void ScriptedProject::run_automation(ItemGroup* group, const QScriptValue& groupObj, const QScriptValue &itemObj, const QScriptValue &items)
 {
     auto automation = m_automation.find(group->type());
-    if (automation != m_automation.cend())
-        callFunction(automation->second, { (groupObj.isValid() ? groupObj : eng->newQObject(group)), itemObj });
+    if (automation == m_automation.cend())
+        return;
+
+    QScriptValueList args{ (groupObj.isValid() ? groupObj : wrap(group)), itemObj };
+    if (items.isValid())
+        args.push_back(items);
+    callFunction(automation->second, args);
 }
 
 void ScriptedProject::groupModeChanged(uint mode, quint32 /*group_id*/)
@@ -495,7 +673,17 @@ void ScriptedProject::groupModeChanged(uint mode, quint32 /*group_id*/)
     auto group = static_cast<ItemGroup*>(sender());
     if (!group)
         return;
-    QScriptValue groupObj = eng->newQObject(group);
+
+    QPointer<ItemGroup> group_ptr(group);
+    if (defer([this, group_ptr, mode]() { if (group_ptr) processModeChanged(group_ptr, mode); }))
+        return;
+
+    processModeChanged(group, mode);
+}
+
+void ScriptedProject::processModeChanged(ItemGroup *group, uint mode)
+{
+    QScriptValue groupObj = wrap(group);
 
     callFunction(fModeChanged, { groupObj, mode });
     run_automation(group, groupObj);
@@ -504,13 +692,50 @@ void ScriptedProject::groupModeChanged(uint mode, quint32 /*group_id*/)
 QElapsedTimer t;
 void ScriptedProject::itemChanged(DeviceItem *item)
 {
+    auto group = static_cast<ItemGroup*>(sender());
+
+    QPointer<ItemGroup> group_ptr(group);
+    QPointer<DeviceItem> item_ptr(item);
+    if (defer([this, group_ptr, item_ptr]() { if (group_ptr && item_ptr) processItemChanged(group_ptr, item_ptr); }))
+        return;
+
+    processItemChanged(group, item);
+}
+
+void ScriptedProject::processItemChanged(ItemGroup *group, DeviceItem *item)
+{
+    if (m_tick_ms > 0)
+    {
+        // Адрес удалённой группы мог достаться новой
+        ChangedItems& changed = m_changed_items[group];
+        if (changed.group != group)
+            changed = ChangedItems{ group, {} };
+        if (!changed.items.contains(item))
+            changed.items.push_back(item);
+        if (!m_tick_timer.isActive())
+            m_tick_timer.start(m_tick_ms);
+        return;
+    }
+
     t.restart();
 
-    auto group = static_cast<ItemGroup*>(sender());
+    QScriptValue groupObj = wrap(group);
+    QScriptValue itemObj = wrap(item);
+
+    callItemHandlers(group, groupObj, item, itemObj);
+    run_automation(group, groupObj, itemObj);
+
+//    eng->collectGarbage();
+
+    if (t.elapsed() > 500)
+        qCWarning(ProjectLog) << "itemChanged timeout" << t.elapsed();
 
-    QScriptValue groupObj = eng->newQObject(group);
-    QScriptValue itemObj = eng->newQObject(item);
+    t.invalidate();
+}
 
+void ScriptedProject::callItemHandlers(ItemGroup *group, const QScriptValue &groupObj, DeviceItem *item, const QScriptValue &itemObj)
+{
+    // Общие функции вызываются всегда, подписки их не отключают, см. subscribe
     callFunction(fItemChanged, { groupObj, itemObj });
 
     if (item->isControl())
@@ -518,14 +743,107 @@ void ScriptedProject::itemChanged(DeviceItem *item)
     else
         callFunction(fSensorChanged, { groupObj, itemObj });
 
-    run_automation(group, groupObj, itemObj);
+    if (m_subscriptions.empty())
+        return;
 
-//    eng->collectGarbage();
+    // Копия: обработчик может вызвать api.subscribe
+    const QScriptValueList handlers = subscribers(group->type(), item->type());
+    for (const QScriptValue& handler: handlers)
+    {
+        // Обработчик отключается так же, как функции проекта
+        const qint64 handler_id = handler.objectId();
+        if (m_disabled_handlers.count(handler_id))
+            continue;
+
+        bool aborted;
+        call(handler, { groupObj, itemObj }, QStringLiteral("subscribe"), &aborted);
+        if (aborted)
+        {
+            if (abortedCall(m_handler_aborts[handler_id], "subscribe " + handler.property("name").toString()))
+                m_disabled_handlers.insert(handler_id);
+        }
+        else if (!m_handler_aborts.empty())
+            m_handler_aborts.erase(handler_id);
+    }
+}
 
-    if (t.elapsed() > 500)
-        qCWarning(ProjectLog) << "itemChanged timeout" << t.elapsed();
+const QScriptValueList &ScriptedProject::subscribers(uint group_type, uint item_type)
+{
+    const std::pair<uint, uint> key{group_type, item_type};
+    auto it = m_subscribers.find(key);
+    if (it != m_subscribers.cend())
+        return it->second;
+
+    // 0 - любой тип группы или элемента
+    QScriptValueList& handlers = m_subscribers[key];
+    const std::set<std::pair<uint, uint>> keys{ key, {group_type, 0u}, {0u, item_type}, {0u, 0u} };
+    for (const std::pair<uint, uint>& sub_key: keys)
+    {
+        auto sub_it = m_subscriptions.find(sub_key);
+        if (sub_it != m_subscriptions.cend())
+            handlers += sub_it->second;
+    }
+    return handlers;
+}
 
-    t.invalidate();
+void ScriptedProject::subscribe(uint group_type, const QScriptValue &item_types, const QScriptValue &handler)
+{
+    if (!handler.isFunction())
+    {
+        qCWarning(ScriptLog) << "subscribe: handler is not a function";
+        return;
+    }
+
+    std::vector<uint> types;
+    if (item_types.isArray())
+    {
+        const quint32 length = item_types.property("length").toUInt32();
+        for (quint32 i = 0; i < length; ++i)
+            types.push_back(item_types.property(i).toUInt32());
+    }
+    else
+        types.push_back(item_types.toUInt32());
+
+    for (uint item_type: types)
+        m_subscriptions[std::make_pair(group_type, item_type)].push_back(handler);
+    m_subscribers.clear();
+}
+
+void ScriptedProject::changedItemsTick()
+{
+    if (defer([this]() { changedItemsTick(); }))
+        return;
+
+    std::map<ItemGroup*, ChangedItems> changed = std::move(m_changed_items);
+    m_changed_items.clear();
+
+    for (const auto& it: changed)
+    {
+        ItemGroup* group = it.second.group;
+        if (!group)
+            continue;
+
+        QScriptValue groupObj = wrap(group);
+        QScriptValue items = eng->newArray();
+        QScriptValue itemObj;
+
+        quint32 i = 0;
+        for (const QPointer<DeviceItem>& item: it.second.items)
+        {
+            // Обработчик предыдущего элемента мог удалить группу
+            if (!item || !it.second.group)
+                continue;
+
+            itemObj = wrap(item);
+            items.setProperty(i++, itemObj);
+
+            // Общие обработчики остаются поштучными, но без них в JS ничего не уходит
+            callItemHandlers(group, groupObj, item, itemObj);
+        }
+
+        if (i > 0 && it.second.group)
+            run_automation(group, groupObj, itemObj, items);
+    }
 }
 
 void ScriptedProject::statusChanged(quint32 status)
@@ -574,41 +892,55 @@ QVariantMap ScriptedProject::run_command(const QString &programm, const QVariant
     return result;
 }
 
+void ScriptedProject::dayPartChanged(Section *section, bool is_day)
+{
+    QPointer<Section> section_ptr(section);
+    if (defer([this, section_ptr, is_day]() { if (section_ptr) dayPartChanged(section_ptr, is_day); }))
+        return;
+
+    callFunction(fDayPartChanged, { wrap(section), is_day });
+}
+
 void ScriptedProject::groupInitialized(ItemGroup* group)
 {
+    QPointer<ItemGroup> group_ptr(group);
+    if (defer([this, group_ptr]() { if (group_ptr) groupInitialized(group_ptr); }))
+        return;
+
     QString func_name = GroupTypeMng.name(group->type()) + "Initialized";
     auto func = eng->currentContext()->activationObject().property(func_name);
     if (func.isFunction())
-    {
-        auto ret = func.call(QScriptValue(), QScriptValueList{ eng->newQObject(group) });
-        check_error( func.property("name").toString(), ret);
-    }
+        call(func, { wrap(group) }, func_name);
     else
         qCDebug(ScriptLog) << "Group type" << group->type() << GroupTypeMng.name(group->type()) << "havent init function" << func_name;
 }
 
+// normalize, controlChangeCheck, checkValue и groupStatus нужен ответ сразу, отложить их нельзя.
+// Посреди вызова они приходят вложенными так же, как когда скрипт сам меняет элемент:
+// QtScript допускает вложенные вызовы, а время идёт в счёт внешнего вызова.
+// Эти функции только вычисляют ответ по аргументам и не должны менять состояние проекта
 QVariant ScriptedProject::normalize(const QVariant &val)
 {
-    return callFunction(fNormalize, { eng->newQObject(sender()), valueFromVariant(val) }).toVariant();
+    return callFunction(fNormalize, { wrap(sender()), valueFromVariant(val) }).toVariant();
 }
 
 bool ScriptedProject::controlChangeCheck(DeviceItem *item, const QVariant &raw_data)
 {
-    auto ret = callFunction(fControlChangeCheck, { eng->newQObject(sender()), eng->newQObject(item), valueFromVariant(raw_data) });
+    auto ret = callFunction(fControlChangeCheck, { wrap(sender()), wrap(item), valueFromVariant(raw_data) });
     return ret.isBool() && ret.toBool();
 }
 
 bool ScriptedProject::checkValue(DeviceItem* item) const
 {
-    auto ret = callFunction(fCheckValue, { eng->newQObject(sender()),
+    auto ret = callFunction(fCheckValue, { wrap(sender()),
                                            valueFromVariant(item->getValue()),
-                                           eng->newQObject(item) });
+                                           wrap(item) });
     return ret.isBool() && ret.toBool();
 }
 
 quint32 ScriptedProject::groupStatus(ItemGroup::ValueType val) const
 {
-    auto ret = callFunction(fGroupStatus, { eng->newQObject(sender()), eng->toScriptValue(val) });
+    auto ret = callFunction(fGroupStatus, { wrap(sender()), eng->toScriptValue(val) });
     return ret.isNumber() ? ret.toUInt32() : val->status();
 }
 
@@ -631,7 +963,9 @@ void ScriptedProject::check_error(const QString& str, const QScriptValue& result
 
 void ScriptedProject::check_error(const QString &name, const QString &code) const
 {
-    check_error(name, eng->evaluate(code, name));
+    const QString error = m_engine->evaluate(code, name);
+    if (!error.isEmpty())
+        qCCritical(ProjectLog) << QString::fromLatin1("%0 %1").arg(name).arg(error);
 }
 
 } // namespace Dai
@@ -2,6 +2,13 @@
 #define SCRIPTEDPROJECT_H
 
 #include <QScriptEngine>
+#include <QTimer>
+#include <QPointer>
+
+#include <set>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <QtSerialBus/qmodbusdataunit.h>
 //#include <QQmlEngine>
 
@@ -12,6 +19,7 @@
 
 #include "tools/daytimehelper.h"
 #include "tools/automationhelper.h"
+#include "scriptprofiler.h"
 
 class QScriptEngine;
 
@@ -26,6 +34,7 @@ class DBManager;
 
 class AutomationHelper;
 class DayTimeHelper;
+class ScriptEngine;
 
 class ScriptedProject : public Project
 {
@@ -51,7 +60,8 @@ public:
     };
     Q_ENUM(ScriptFunction)
 
-    ScriptedProject(Worker* worker, Helpz::ConsoleReader* consoleReader, const QString &sshHost, bool allow_shell);
+    ScriptedProject(Worker* worker, Helpz::ConsoleReader* consoleReader, const QString &sshHost, bool allow_shell, int tick_ms = 0,
+                    int call_budget_ms = 0, int max_aborts = 3);
     ~ScriptedProject();
 
     void setSSHHost(const QString &value);
@@ -60,6 +70,8 @@ public:
     Section *addSection(quint32 id, const QString &name, const TimeRange &dayTime) override;
 
     QScriptValue valueFromVariant(const QVariant& data) const;
+
+    const ScriptProfiler& profiler() const;
 signals:
     void sctItemChanged(DeviceItem*);
     void groupStatusChanged(quint32 group_id, quint32 status);
@@ -82,7 +94,21 @@ public slots:
 
     void ssh(quint16 port = 22, quint32 remote_port = 25589);
     QVariantMap run_command(const QString& programm, const QVariantList& args = QVariantList(), int timeout_msec = 5000) const;
+
+    // api.subscribe: handler(group, item) вызывается только для элементов item_types
+    // (число или массив) в группах group_type, 0 - любой тип.
+    // Подписки не заменяют itemChanged, sensorChanged и controlChanged: если скрипт их
+    // объявил, они по-прежнему вызываются для каждого элемента. Чтобы изменения
+    // элемента не шли в JS зря, в скрипте остаются только подписки
+    void subscribe(uint group_type, const QScriptValue& item_types, const QScriptValue& handler);
+
+    // Для консоли: api.profile()
+    QString profile(int top = 10) const;
+    void profileReset();
 private slots:
+    void dayPartChanged(Section* section, bool is_day);
+    void callTimeout();
+    void runDeferred();
     void groupInitialized(ItemGroup* group);
     QVariant normalize(const QVariant& val);
 //    void dayTimeChanged(Section* sct);
@@ -93,10 +119,18 @@ private slots:
 
     void groupModeChanged(uint mode, quint32 group_id);
     void itemChanged(DeviceItem* item);
+    void changedItemsTick();
     void statusChanged(quint32 status);
     void handlerException(const QScriptValue &exception);
 private:
-    void run_automation(ItemGroup *group, const QScriptValue &groupObj, const QScriptValue& itemObj = QScriptValue());
+    void processModeChanged(ItemGroup* group, uint mode);
+    void processItemChanged(ItemGroup* group, DeviceItem* item);
+    void callItemHandlers(ItemGroup* group, const QScriptValue& groupObj, DeviceItem* item, const QScriptValue& itemObj);
+    const QScriptValueList& subscribers(uint group_type, uint item_type);
+    // Автоматика получает (группа, элемент), а при ScriptTickMs третьим аргументом ещё
+    // массив всех элементов, изменившихся за такт; элемент тогда - последний из них
+    void run_automation(ItemGroup *group, const QScriptValue &groupObj, const QScriptValue& itemObj = QScriptValue(),
+                        const QScriptValue& items = QScriptValue());
     void check_error(const QString &str, const QScriptValue &result) const;
     void check_error(const QString &name, const QString &code) const;
 
@@ -123,13 +157,64 @@ private:
     void scriptsInitialization();
 //    void evaluateFile(const QString &fileName);
     QScriptValue callFunction(uint func_idx, const QScriptValueList& args = QScriptValueList()) const;
+    // Единственное место, где C++ вызывает функцию скрипта: профилировщик, сторож и ошибки
+    QScriptValue call(QScriptValue func, const QScriptValueList& args, const QString& name, bool* aborted = nullptr) const;
+    const QString& functionName(uint func_idx) const;
+    // Считает прерывания подряд, true - функцию пора отключить
+    bool abortedCall(int& count, const QString& name) const;
+    void endCall() const;
+
+    // Пока скрипт выполняется, движок обрабатывает события ради сторожа.
+    // Слот, пришедший в это время, откладывается до конца вызова и возвращает true
+    bool defer(std::function<void()> func);
+
+    // Обёртка объекта создаётся один раз и живёт до удаления объекта или reinitialization.
+    // Поэтому свойства, которые скрипт добавил группе или элементу, видны при следующих вызовах,
+    // а обёртки одного объекта равны (===). Сбрасываются они только вместе с кэшем
+    QScriptValue wrap(QObject* obj) const;
 
     QScriptEngine *eng;
+    std::unique_ptr<ScriptEngine> m_engine;
+    mutable std::map<QObject*, QScriptValue> m_wrappers;
 
     std::vector<QScriptValue> m_func;
+    mutable std::vector<QString> m_func_names;
+    mutable ScriptProfiler m_profiler;
+
+    // Сторож: вызов из C++ дольше m_call_budget_ms прерывается (на деле через
+    // m_call_budget_ms..2*m_call_budget_ms, события обрабатываются раз в бюджет),
+    // функция, прерванная m_max_aborts раз подряд, отключается до reinitialization.
+    // 0 - сторож выключен
+    int m_call_budget_ms, m_max_aborts;
+    mutable int m_call_depth = 0;
+    std::deque<std::function<void()>> m_deferred;
+    bool m_running_deferred = false;
+    mutable bool m_call_aborted = false;
+    mutable QTimer m_watchdog;
+    mutable std::map<uint, int> m_aborts;
+    mutable std::set<uint> m_disabled;
+    // То же для обработчиков api.subscribe, ключ - QScriptValue::objectId
+    std::map<qint64, int> m_handler_aborts;
+    std::set<qint64> m_disabled_handlers;
 
     std::map<uint, uint> m_automation;
 
+    // Если m_tick_ms > 0, изменения копятся за такт и автоматика группы
+    // вызывается один раз с массивом изменившихся элементов.
+    // Группа или элемент могут быть удалены до конца такта, поэтому QPointer
+    int m_tick_ms;
+    QTimer m_tick_timer;
+    struct ChangedItems {
+        QPointer<ItemGroup> group;
+        QVector<QPointer<DeviceItem>> items;
+    };
+    std::map<ItemGroup*, ChangedItems> m_changed_items;
+
+    // (тип группы, тип элемента) -> обработчики, как их объявил скрипт
+    std::map<std::pair<uint, uint>, QScriptValueList> m_subscriptions;
+    // То же с учётом 0 - любой, заполняется при первом обращении
+    std::map<std::pair<uint, uint>, QScriptValueList> m_subscribers;
+
     DayTimeHelper m_dayTime;
 
     qint64 m_uptime;
@@ -0,0 +1,27 @@
+#include <QScriptEngine>
+#include <QScriptContext>
+
+#include "scriptengine.h"
+
+namespace Dai {
+
+QScriptBackend::QScriptBackend(QScriptEngine *eng) : eng_(eng) {}
+
+QString QScriptBackend::evaluate(const QString &code, const QString &file_name)
+{
+    QScriptValue res = eng_->evaluate(code, file_name);
+    if (!res.isError())
+        return {};
+    return QString::fromLatin1("%1(%2): %3")
+            .arg(res.property("fileName").toString())
+            .arg(res.property("lineNumber").toInt32())
+            .arg(res.toString());
+}
+
+void QScriptBackend::interrupt()
+{
+    if (eng_->isEvaluating())
+        eng_->abortEvaluation(eng_->currentContext()->throwError(QScriptContext::RangeError, "Script time budget exceeded"));
+}
+
+} // namespace Dai
@@ -0,0 +1,41 @@
+#ifndef SCRIPTENGINE_H
+#define SCRIPTENGINE_H
+
+#include <QString>
+
+QT_BEGIN_NAMESPACE
+class QScriptEngine;
+QT_END_NAMESPACE
+
+namespace Dai {
+
+/**
+ * Движок скриптов: загрузка кода и прерывание.
+ * ScriptedProject загружает код и прерывает вызовы только через него.
+ * Значения, функции и типы для скриптов остаются в QtScript.
+ */
+class ScriptEngine
+{
+public:
+    virtual ~ScriptEngine() = default;
+
+    // Выполняет код в текущем контексте движка. Возвращает "файл(строка): ошибка" или пустую строку
+    virtual QString evaluate(const QString& code, const QString& file_name) = 0;
+    // Прерывает выполняемый скрипт, вызывается из потока движка
+    virtual void interrupt() = 0;
+};
+
+class QScriptBackend final : public ScriptEngine
+{
+public:
+    explicit QScriptBackend(QScriptEngine* eng);
+
+    QString evaluate(const QString& code, const QString& file_name) override;
+    void interrupt() override;
+private:
+    QScriptEngine* eng_;
+};
+
+} // namespace Dai
+
+#endif // SCRIPTENGINE_H
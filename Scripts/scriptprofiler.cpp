@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <vector>
+
+#include <QJsonArray>
+
+#include "scriptprofiler.h"
+
+namespace Dai {
+
+ScriptProfiler::Scope::Scope(ScriptProfiler *profiler, const QString &name) :
+    profiler_(profiler), name_(name)
+{
+    timer_.start();
+}
+
+ScriptProfiler::Scope::~Scope()
+{
+    profiler_->add(name_, timer_.nsecsElapsed());
+}
+
+void ScriptProfiler::add(const QString &name, qint64 ns)
+{
+    const qint64 us = ns / 1000;
+    int bucket = 0;
+    while (bucket < bucket_count - 1 && (qint64(1) << (bucket + 1)) <= us)
+        ++bucket;
+
+    QMutexLocker lock(&mutex_);
+    Function& func = functions_[name];
+    ++func.calls;
+    func.total_ns += ns;
+    func.max_ns = std::max(func.max_ns, ns);
+    ++func.buckets[bucket];
+}
+
+void ScriptProfiler::addAbort(const QString &name)
+{
+    QMutexLocker lock(&mutex_);
+    ++functions_[name].aborts;
+}
+
+void ScriptProfiler::reset()
+{
+    QMutexLocker lock(&mutex_);
+    functions_.clear();
+}
+
+QJsonObject ScriptProfiler::stats(int top) const
+{
+    QMutexLocker lock(&mutex_);
+
+    std::vector<QHash<QString, Function>::const_iterator> sorted;
+    sorted.reserve(functions_.size());
+    quint64 calls = 0;
+    qint64 total_ns = 0;
+    for (auto it = functions_.cbegin(); it != functions_.cend(); ++it)
+    {
+        sorted.push_back(it);
+        calls += it->calls;
+        total_ns += it->total_ns;
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](QHash<QString, Function>::const_iterator a, QHash<QString, Function>::const_iterator b)
+    {
+        return a->total_ns > b->total_ns;
+    });
+    if (top > 0 && sorted.size() > static_cast<std::size_t>(top))
+        sorted.resize(top);
+
+    QJsonArray functions;
+    for (auto it: sorted)
+    {
+        QJsonObject obj;
+        obj["name"] = it.key();
+        obj["calls"] = static_cast<qint64>(it->calls);
+        obj["total_ms"] = it->total_ns / 1000000.;
+        obj["avg_us"] = it->calls ? it->total_ns / 1000. / it->calls : 0.;
+        obj["p50_us"] = it->percentileUs(0.5);
+        obj["p99_us"] = it->percentileUs(0.99);
+        obj["max_us"] = it->max_ns / 1000;
+        obj["aborts"] = static_cast<qint64>(it->aborts);
+        functions.push_back(obj);
+    }
+
+    QJsonObject obj;
+    obj["calls"] = static_cast<qint64>(calls);
+    obj["total_ms"] = total_ns / 1000000.;
+    obj["functions"] = functions;
+    return obj;
+}
+
+qint64 ScriptProfiler::Function::percentileUs(double p) const
+{
+    const quint64 rank = static_cast<quint64>(calls * p);
+    quint64 count = 0;
+    for (int i = 0; i < bucket_count; ++i)
+    {
+        count += buckets[i];
+        if (count > rank)
+            return qint64(1) << (i + 1); // верхняя граница интервала
+    }
+    return max_ns / 1000;
+}
+
+} // namespace Dai
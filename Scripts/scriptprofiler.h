@@ -0,0 +1,58 @@
+#ifndef SCRIPTPROFILER_H
+#define SCRIPTPROFILER_H
+
+#include <array>
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QMutex>
+
+namespace Dai {
+
+/**
+ * Время выполнения функций скриптов.
+ * Для каждой функции хранится количество вызовов, суммарное и максимальное
+ * время и гистограмма по степеням двойки в микросекундах, из которой
+ * берутся p50 и p99 (с точностью до интервала гистограммы).
+ */
+class ScriptProfiler
+{
+public:
+    class Scope {
+    public:
+        Scope(ScriptProfiler* profiler, const QString& name);
+        ~Scope();
+    private:
+        ScriptProfiler* profiler_;
+        QString name_;
+        QElapsedTimer timer_;
+    };
+
+    void add(const QString& name, qint64 ns);
+    // Вызов прерван по превышению времени
+    void addAbort(const QString& name);
+    void reset();
+
+    // Thread-safe. top функций с наибольшим суммарным временем
+    QJsonObject stats(int top = 10) const;
+private:
+    static const int bucket_count = 32;
+
+    struct Function {
+        quint64 calls = 0;
+        qint64 total_ns = 0;
+        qint64 max_ns = 0;
+        quint64 aborts = 0;
+        std::array<quint64, bucket_count> buckets{};
+
+        qint64 percentileUs(double p) const;
+    };
+
+    mutable QMutex mutex_;
+    QHash<QString, Function> functions_;
+};
+
+} // namespace Dai
+
+#endif // SCRIPTPROFILER_H
@@ -19,7 +19,16 @@ SOURCES += main.cpp \
     worker.cpp \
     checker.cpp \
     Network/n_client.cpp \
+    Network/outbox.cpp \
+    Network/value_pack_codec.cpp \
+    Network/structure_hash.cpp \
+    Network/file_receiver.cpp \
+    Network/send_scheduler.cpp \
     Database/db_manager.cpp \
+    Database/log_value_store.cpp \
+    Database/log_archive.cpp \
+    Database/log_compactor.cpp \
+    Database/log_rollup.cpp \
     Scripts/tools/pidcontroller.cpp \
     Scripts/tools/automationhelper.cpp \
     Scripts/tools/resthelper.cpp \
@@ -29,13 +38,28 @@ SOURCES += main.cpp \
     Scripts/tools/inforegisterhelper.cpp \
     Scripts/paramgroupclass.cpp \
     Scripts/paramgroupprototype.cpp \
-    Scripts/scriptedproject.cpp
+    Scripts/scriptedproject.cpp \
+    Scripts/scriptprofiler.cpp \
+    Scripts/scriptengine.cpp
 
 HEADERS  += \
     worker.h \
     checker.h \
     Network/n_client.h \
+    Network/outbox.h \
+    Network/pack_lane.h \
+    Network/value_pack_codec.h \
+    Network/structure_hash.h \
+    Network/file_receiver.h \
+    Network/send_scheduler.h \
+    Network/value_batch.h \
+    Network/cached_call.h \
     Database/db_manager.h \
+    Database/log_value_store.h \
+    Database/bit_stream.h \
+    Database/log_archive.h \
+    Database/log_compactor.h \
+    Database/log_rollup.h \
     Scripts/tools/pidcontroller.h \
     Scripts/tools/automationhelper.h \
     Scripts/tools/resthelper.h \
@@ -45,7 +69,9 @@ HEADERS  += \
     Scripts/tools/inforegisterhelper.h \
     Scripts/paramgroupprototype.h \
     Scripts/paramgroupclass.h \
-    Scripts/scriptedproject.h
+    Scripts/scriptedproject.h \
+    Scripts/scriptprofiler.h \
+    Scripts/scriptengine.h
 
 #Target version
 VER_MAJ = 1
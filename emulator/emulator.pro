@@ -17,11 +17,18 @@ LIBS += -lDai -lDaiPlus -lHelpzBase -lHelpzService -lHelpzDB -lHelpzNetwork -lbo
 
 SOURCES += main.cpp \
     ../Database/db_manager.cpp \
+    ../Database/log_value_store.cpp \
+    ../Database/log_archive.cpp \
+    ../Database/log_rollup.cpp \
     mainwindow.cpp \
     mainbox.cpp
 
 HEADERS  += \ 
     ../Database/db_manager.h \
+    ../Database/log_value_store.h \
+    ../Database/log_archive.h \
+    ../Database/log_rollup.h \
+    ../Database/bit_stream.h \
     mainwindow.h \
     mainbox.h
 
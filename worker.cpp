@@ -7,24 +7,32 @@
 #include <QJsonArray>
 #include <QJsonDocument>
 
+#include <random>
+
 #include <Helpz/consolereader.h>
 
 #include <Dai/commands.h>
 #include <Dai/checkerinterface.h>
 
+#include "Database/log_archive.h"
 #include "worker.h"
 
 namespace Dai {
 
-WebSockItem::WebSockItem(Worker *obj) :
+WebSockItem::WebSockItem(Worker *obj, int max_frame_rate) :
     QObject(), project::base(),
-    w(obj)
+    w(obj), frame_interval_ms_(1000 / std::max(1, max_frame_rate))
 {
+    std::random_device rd;
+    run_id_ = (static_cast<quint64>(rd()) << 32) | rd();
+
     set_id(1);
     set_title("localhost");
     set_teams({1});
     connect(w, &Worker::modeChanged, this, &WebSockItem::modeChanged, Qt::QueuedConnection);
 
+    frame_timer_.setSingleShot(true);
+    connect(&frame_timer_, &QTimer::timeout, this, &WebSockItem::sendValuesFrame);
 }
 
 WebSockItem::~WebSockItem() {
@@ -37,6 +45,78 @@ void WebSockItem::modeChanged(uint mode_id, uint group_id) {
                               Q_ARG(ProjInfo, this), Q_ARG(quint32, mode_id), Q_ARG(quint32, group_id));
 }
 
+void WebSockItem::sendValues(const ValueBatchPtr &batch)
+{
+    for (int i = 0; i < batch->items().size(); ++i)
+    {
+        const ValuePackItem& item = batch->items().at(i);
+        // Только для типов из [WebSocket] CoalesceItemTypes кадр несёт последнее значение элемента
+        if (batch->flags().at(i) & ValueBatch::WebSockCoalesce)
+        {
+            auto it = latest_.find(item.item_id);
+            if (it != latest_.end())
+            {
+                values_[it.value()] = item;
+                continue;
+            }
+            latest_.insert(item.item_id, values_.size());
+        }
+        values_.push_back(item);
+    }
+
+    if (frame_timer_.isActive())
+        return;
+
+    const qint64 elapsed = last_frame_.isValid() ? last_frame_.elapsed() : frame_interval_ms_;
+    if (elapsed >= frame_interval_ms_)
+        sendValuesFrame();
+    else
+        frame_timer_.start(frame_interval_ms_ - elapsed);
+}
+
+void WebSockItem::sendValuesFrame()
+{
+    if (values_.isEmpty() || !w->webSock_th)
+        return;
+
+    ++seq_;
+    QVector<ValuePackItem> pack;
+    pack.swap(values_);
+    latest_.clear();
+    for (const ValuePackItem& item: pack)
+        last_values_[item.item_id] = LastValue{seq_, item};
+
+    last_frame_.start();
+    QMetaObject::invokeMethod(w->webSock_th->ptr(), "sendDeviceItemValues", Qt::QueuedConnection,
+                              QArgument<project::info>("ProjInfo", this), Q_ARG(QVector<Dai::ValuePackItem>, pack));
+
+    // Формат кадра значений задан библиотекой, номер уходит следом отдельным кадром.
+    // Оба вызова идут через одну очередь потока WebSocket, порядок сохраняется
+    QByteArray frame;
+    QDataStream ds(&frame, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_5_7);
+    ds << static_cast<quint8>(wsValuesSeq) << run_id_ << seq_;
+    emit send(this, frame);
+}
+
+QByteArray WebSockItem::snapshot(quint32 request_id, quint64 run_id, quint64 since_seq) const
+{
+    // Номер из другого запуска ничего не значит
+    const bool full = run_id != run_id_ || since_seq == 0 || since_seq > seq_;
+
+    QVector<ValuePackItem> pack;
+    if (!full)
+        for (const auto& it: last_values_)
+            if (it.second.seq > since_seq)
+                pack.push_back(it.second.item);
+
+    QByteArray frame;
+    QDataStream ds(&frame, QIODevice::WriteOnly);
+    ds.setVersion(QDataStream::Qt_5_7);
+    ds << static_cast<quint8>(wsValuesSnapshot) << request_id << run_id_ << seq_ << full << pack;
+    return frame;
+}
+
 void WebSockItem::procCommand(quint32 user_team_id, quint32 proj_id, quint8 cmd, const QByteArray &data)
 {
     QDataStream ds(data);
@@ -44,8 +124,16 @@ void WebSockItem::procCommand(quint32 user_team_id, quint32 proj_id, quint8 cmd,
     try {
         switch (cmd) {
         case wsConnectInfo:
-            send(this, w->webSock_th->ptr()->getConnectState(id(), "127.0.0.1", QDateTime::currentDateTime().timeZone(), 0));
+        {
+            // Значения, ещё не ушедшие кадром, придут следующим кадром с номером seq_ + 1.
+            // Снимок помечен номером запроса клиента, остальные вкладки его пропускают
+            quint32 request_id = 0;
+            quint64 run_id = 0, since_seq = 0;
+            if (!ds.atEnd())
+                ds >> request_id >> run_id >> since_seq;
+            emit connectInfo(snapshot(request_id, run_id, since_seq));
             break;
+        }
 
         case wsWriteToDevItem: Helpz::applyParse(&Worker::writeToItem, w, ds); break;
         case wsChangeGroupMode: Helpz::applyParse(&Worker::setMode, w, ds); break;
@@ -78,6 +166,7 @@ Worker::Worker(QObject *parent) :
 
     int log_period = init_logging(s.get());
     init_Database(s.get());
+    init_LogArchive(s.get());
     init_Project(s.get());
     init_Checker(s.get());
     init_GlobalClient(s.get());
@@ -96,6 +185,8 @@ Worker::~Worker()
     if (webSock_th)
         webSock_th->quit();
     django_th->quit();
+    if (log_compactor_th)
+        log_compactor_th->quit();
 
     logTimer.stop();
 
@@ -103,6 +194,8 @@ Worker::~Worker()
     checker_th->quit();
 
     g_mng_th->quit();
+    for (NetworkClientThread::Type* thread: mirror_th_)
+        thread->quit();
     prj->quit();
 
     if (webSock_th && !webSock_th->wait(15000))
@@ -111,23 +204,33 @@ Worker::~Worker()
         django_th->terminate();
     if (!g_mng_th->wait(15000))
         g_mng_th->terminate();
+    for (NetworkClientThread::Type* thread: mirror_th_)
+        if (!thread->wait(15000))
+            thread->terminate();
     if (!checker_th->wait(15000))
         checker_th->terminate();
     if (!prj->wait(15000))
         prj->terminate();
+    if (log_compactor_th && !log_compactor_th->wait(15000))
+        log_compactor_th->terminate();
 
     if (webSock_th)
         delete webSock_th;
     delete django_th;
     delete g_mng_th;
+    for (NetworkClientThread::Type* thread: mirror_th_)
+        delete thread;
     delete checker_th;
     delete prj;
+    if (log_compactor_th)
+        delete log_compactor_th;
 
     delete db_mng;
 }
 
 DBManager* Worker::database() const { return db_mng; }
 const Helpz::Database::ConnectionInfo &Worker::database_info() const { return *db_info_; }
+std::shared_ptr<LogArchive> Worker::log_archive() const { return log_archive_; }
 
 std::unique_ptr<QSettings> Worker::settings()
 {
@@ -176,10 +279,57 @@ void Worker::init_Database(QSettings* s)
         throw std::runtime_error("Failed get database config");
 
     db_mng = new DBManager(*db_info_, "Worker_" + QString::number((quintptr)this));
+
+    std::tuple<bool, QString, int, int, int> store_t = Helpz::SettingsHelper<Z::Param<bool>,Z::Param<QString>,Z::Param<int>,Z::Param<int>,Z::Param<int>>(
+                s, "LogStore",
+                Z::Param<bool>{"Enabled", false},
+                Z::Param<QString>{"Path", "logstore"},
+                Z::Param<int>{"SegmentSizeKB", 4096},
+                Z::Param<int>{"MaxSegments", 256},
+                Z::Param<int>{"MaxMappedSegments", 4}
+    )();
+    QString store_path = std::get<1>(store_t);
+    if (QDir::isRelativePath(store_path))
+        store_path = QCoreApplication::applicationDirPath() + QDir::separator() + store_path;
+
+    if (!std::get<0>(store_t))
+        db_mng->retireLogStore(store_path, std::get<2>(store_t) * 1024LL);
+    else if (!db_mng->initLogStore(store_path, std::get<2>(store_t) * 1024LL, std::get<3>(store_t), std::get<4>(store_t)))
+        qCCritical(Service::Log) << "Failed to open value log store" << store_path;
+
     connect(this, &Worker::statusAdded, db_mng, &DBManager::addStatus, Qt::QueuedConnection);
     connect(this, &Worker::statusRemoved, db_mng, &DBManager::removeStatus, Qt::QueuedConnection);
 }
 
+void Worker::init_LogArchive(QSettings *s)
+{
+    std::tuple<bool, QString> arch_t = Helpz::SettingsHelper<Z::Param<bool>,Z::Param<QString>>(
+                s, "LogArchive",
+                Z::Param<bool>{"Enabled", false},
+                Z::Param<QString>{"Path", "archive"}
+    )();
+    if (!std::get<0>(arch_t))
+        return;
+
+    QString path = std::get<1>(arch_t);
+    if (QDir::isRelativePath(path))
+        path = QCoreApplication::applicationDirPath() + QDir::separator() + path;
+
+    log_archive_ = std::make_shared<LogArchive>(path);
+    if (!log_archive_->open())
+    {
+        qCCritical(Service::Log) << "Failed to open value log archive" << path;
+        log_archive_.reset();
+        return;
+    }
+    db_mng->setLogArchive(log_archive_);
+
+    log_compactor_th = LogCompactorThread()(s, "LogArchive", this,
+                                            Z::Param<int>{"KeepDays", 30},
+                                            Z::Param<int>{"CheckIntervalMinutes", 60});
+    log_compactor_th->start(QThread::LowPriority);
+}
+
 void Worker::init_Project(QSettings* s)
 {
     Helpz::ConsoleReader* cr = nullptr;
@@ -191,7 +341,10 @@ void Worker::init_Project(QSettings* s)
     prj = ScriptsThread()(s, "Server", this,
                           cr,
                           Z::Param<QString>{"SSHHost", "80.89.129.98"},
-                          Z::Param<bool>{"AllowShell", false}
+                          Z::Param<bool>{"AllowShell", false},
+                          Z::Param<int>{"ScriptTickMs", 0},
+                          Z::Param<int>{"ScriptCallBudgetMs", 0},
+                          Z::Param<int>{"ScriptMaxAborts", 3}
                           );
     prj->start(QThread::HighPriority);
 //    while (!prj->ptr() && !prj->wait(5));
@@ -211,23 +364,61 @@ void Worker::init_GlobalClient(QSettings* s)
     qRegisterMetaType<QVector<ValuePackItem>>("QVector<Dai::ValuePackItem>");
     qRegisterMetaType<QVector<EventPackItem>>("QVector<Dai::EventPackItem>");
     qRegisterMetaType<QVector<quint32>>("QVector<quint32>");
+    qRegisterMetaType<ValueBatchPtr>("ValueBatchPtr");
 
-    g_mng_th = NetworkClientThread()(
-              s, "RemoteServer",
-              this,
-              Z::Param<QString>{"Host",                 "deviceaccess.ru"},
-              Z::Param<quint16>{"Port",                 (quint16)25588},
-              Z::Param<QString>{"Login",                QString()},
-              Z::Param<QString>{"Password",             QString()},
-              Z::Param<QUuid>{"Device",               QUuid()},
-              Z::Param<int>{"CheckServerInterval",  15000}
-            );
+    std::tuple<QString> coalesce_t = Helpz::SettingsHelper<Z::Param<QString>>(
+                s, "RemoteServer",
+                Z::Param<QString>{"CoalesceItemTypes", QString()}
+    )();
+    for (const QString& type_id: std::get<0>(coalesce_t).split(',', QString::SkipEmptyParts))
+        coalesce_item_types_.insert(type_id.trimmed().toUInt());
 
-    g_mng_th->start();
+    auto createClient = [this, s](const QString& group, const QString& outbox_file, bool mirror)
+    {
+        NetworkClientThread::Type* thread = NetworkClientThread()(
+                  s, group,
+                  this, mirror,
+                  Z::Param<QString>{"Host",                 "deviceaccess.ru"},
+                  Z::Param<quint16>{"Port",                 (quint16)25588},
+                  Z::Param<QString>{"Login",                QString()},
+                  Z::Param<QString>{"Password",             QString()},
+                  Z::Param<QUuid>{"Device",               QUuid()},
+                  Z::Param<int>{"CheckServerInterval",  15000},
+                  Z::Param<int>{"RateKBps",             0},
+                  Z::Param<int>{"BurstKB",              0},
+                  Z::Param<int>{"HistoryRateKBps",      0},
+                  Z::Param<int>{"HistoryBurstKB",       0},
+                  Z::Param<bool>{"ResumeSession",       false},
+                  Z::Param<QString>{"OutboxFile",       outbox_file},
+                  Z::Param<int>{"OutboxSyncMs",         1000}
+                );
+        thread->start();
+        while (!thread->ptr() && !thread->wait(5));
+        return thread;
+    };
+
+    g_mng_th = createClient("RemoteServer", "outbox.dat", false);
+
+    // Other upstream servers, each has own settings group, outbox and send queue
+    std::tuple<QString> mirrors_t = Helpz::SettingsHelper<Z::Param<QString>>(
+                s, "RemoteServer",
+                Z::Param<QString>{"Mirrors", QString()}
+    )();
+    for (QString group: std::get<0>(mirrors_t).split(',', QString::SkipEmptyParts))
+    {
+        group = group.trimmed();
+        NetworkClientThread::Type* thread = createClient(group, "outbox_" + group + ".dat", true);
+        mirror_th_.push_back(thread);
+    }
 }
 
 void Worker::init_LogTimer(int period)
 {
+    // Новые значения собираются за такт и расходятся всем получателям одним пакетом
+    tick_timer_.setInterval(10);
+    tick_timer_.setSingleShot(true);
+    connect(&tick_timer_, &QTimer::timeout, this, &Worker::sendValueBatch);
+
     connect(&item_values_timer, &QTimer::timeout, [this]()
     {
         std::map<quint32, std::pair<QVariant, QVariant>> values = std::move(waited_item_values);
@@ -271,12 +462,13 @@ void Worker::init_LogTimer(int period)
                     continue;
 
                 db_id.clear();
-                if (db_mng->logChanges(dev_item, cur_date, &db_id))
+                if (db_mng->logValue(dev_item, cur_date, &db_id))
                 {
                     ValuePackItem packItem{ db_id.toUInt(), dev_item->id(), cur_date.toMSecsSinceEpoch(),
                                     dev_item->getRawValue(), dev_item->getValue() };
-                    QMetaObject::invokeMethod(g_mng_th->ptr(), "change", Qt::QueuedConnection,
-                                              Q_ARG(ValuePackItem, packItem), Q_ARG(bool, false));
+                    for (Network::Client* client: clients())
+                        QMetaObject::invokeMethod(client, "change", Qt::QueuedConnection,
+                                                  Q_ARG(ValuePackItem, packItem), Q_ARG(bool, false));
                 }
                 else
                 {
@@ -305,10 +497,20 @@ void Worker::initDjango(QSettings *s)
 
 void Worker::initWebSocketManager(QSettings *s)
 {
-    std::tuple<bool> en_t = Helpz::SettingsHelper<Helpz::Param<bool>>(s, "WebSocket", Helpz::Param<bool>{"Enabled", true})();
+    // MaxFrameRate общий для всех подключений проекта, у клиента своей частоты нет
+    std::tuple<bool, int, int, int, QString> en_t = Helpz::SettingsHelper<Helpz::Param<bool>, Helpz::Param<int>, Helpz::Param<int>, Helpz::Param<int>, Helpz::Param<QString>>(
+                s, "WebSocket",
+                Helpz::Param<bool>{"Enabled", true},
+                Helpz::Param<int>{"MaxFrameRate", 10},
+                Helpz::Param<int>{"AuthCacheSec", 5},
+                Helpz::Param<int>{"AuthSlowMs", 3000},
+                Helpz::Param<QString>{"CoalesceItemTypes", QString()})();
     if (!std::get<0>(en_t))
         return;
 
+    for (const QString& type_id: std::get<4>(en_t).split(',', QString::SkipEmptyParts))
+        websock_coalesce_item_types_.insert(type_id.trimmed().toUInt());
+
     webSock_th = WebSocketThread()(
                 s, "WebSocket",
                 Helpz::Param<QString>{"CertPath", QString()},
@@ -317,13 +519,27 @@ void Worker::initWebSocketManager(QSettings *s)
     webSock_th->start();
 
     while (!webSock_th->ptr() && !webSock_th->wait(5));
-    connect(webSock_th->ptr(), &Network::WebSocket::checkAuth,
-                     django_th->ptr(), &DjangoHelper::checkToken, Qt::BlockingQueuedConnection);
 
-    websock_item.reset(new WebSockItem(this));
+    // Токен проверяется в потоке WebSocket по кэшу, Django вызывается только при промахе,
+    // ожидание дольше AuthSlowMs пишется в лог. Кэш короткий, чтобы отозванный токен быстро переставал работать
+    auth_cache_.reset(new CheckTokenCall(django_th->ptr(), &DjangoHelper::checkToken, std::get<2>(en_t) * 1000, std::get<3>(en_t)));
+    connect(webSock_th->ptr(), &Network::WebSocket::checkAuth, webSock_th->ptr(), *auth_cache_, Qt::DirectConnection);
+
+    // Ответы на команды уходят через send, поэтому ждать их выполнения незачем
+    websock_item.reset(new WebSockItem(this, std::get<1>(en_t)));
     connect(webSock_th->ptr(), &Network::WebSocket::throughCommand,
-            websock_item.get(), &WebSockItem::procCommand, Qt::BlockingQueuedConnection);
+            websock_item.get(), &WebSockItem::procCommand, Qt::QueuedConnection);
     connect(websock_item.get(), &WebSockItem::send, webSock_th->ptr(), &Network::WebSocket::send, Qt::QueuedConnection);
+
+    // Состояние подключения принадлежит WebSocket, поэтому ответ собирается в его потоке.
+    // Снимок уходит следом тем же вызовом, а очередь сохраняет порядок относительно кадров значений
+    connect(websock_item.get(), &WebSockItem::connectInfo, webSock_th->ptr(), [this](const QByteArray& snapshot)
+    {
+        Network::WebSocket* web_sock = webSock_th->ptr();
+        WebSockItem* item = websock_item.get();
+        web_sock->send(item, web_sock->getConnectState(item->id(), "127.0.0.1", QDateTime::currentDateTime().timeZone(), 0));
+        web_sock->send(item, snapshot);
+    }, Qt::QueuedConnection);
 //    webSock_th->ptr()->get_proj_in_team_by_id.connect(
 //                std::bind(&Worker::proj_in_team_by_id, this, std::placeholders::_1, std::placeholders::_2));
 }
@@ -343,7 +559,8 @@ void Worker::logMessage(QtMsgType type, const Helpz::LogContext &ctx, const QStr
     QVariant db_id;
     if (db_mng->eventLog(type, ctx->category, str, cur_date, &db_id)) {
         EventPackItem item{db_id.toUInt(), type, cur_date.toMSecsSinceEpoch(), ctx->category, str};
-        QMetaObject::invokeMethod(g_mng_th->ptr(), "eventLog", Qt::QueuedConnection, Q_ARG(EventPackItem, item));
+        for (Network::Client* client: clients())
+            QMetaObject::invokeMethod(client, "eventLog", Qt::QueuedConnection, Q_ARG(EventPackItem, item));
         if (webSock_th)
             QMetaObject::invokeMethod(webSock_th->ptr(), "sendEventMessage", Qt::QueuedConnection,
                                       QArgument<project::info>("ProjInfo", websock_item.get()), Q_ARG(quint32, db_id.toUInt()), Q_ARG(quint32, item.type_id),
@@ -417,6 +634,76 @@ QString Worker::getUserStatus()
     return QJsonDocument(json).toJson(QJsonDocument::Compact);
 }
 
+QString Worker::getLogRollup(quint32 item_id, qint64 from_ms, qint64 to_ms, qint64 step_ms)
+{
+    QJsonArray json;
+    QJsonObject obj;
+    for (const LogRollup::Point& point: db_mng->getLogRollup(item_id, from_ms, to_ms, step_ms))
+    {
+        obj["time"] = point.time_ms;
+        obj["min"] = point.min;
+        obj["max"] = point.max;
+        obj["avg"] = point.avg();
+        obj["count"] = static_cast<qint64>(point.count);
+        obj["last"] = point.last;
+        json.push_back(obj);
+    }
+
+    return QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+QString Worker::getArchivedValues(quint32 item_id, qint64 from_ms, qint64 to_ms)
+{
+    QJsonArray json;
+    if (!log_archive_)
+        return QJsonDocument(json).toJson(QJsonDocument::Compact);
+
+    QJsonObject obj;
+    for (const ValuePackItem& item: log_archive_->readItem(item_id, from_ms, to_ms))
+    {
+        obj["id"] = static_cast<qint64>(item.id);
+        obj["time"] = item.time_msecs;
+        obj["raw"] = QJsonValue::fromVariant(item.raw_value);
+        obj["value"] = QJsonValue::fromVariant(item.value);
+        json.push_back(obj);
+    }
+
+    return QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+std::vector<Network::Client*> Worker::clients() const
+{
+    std::vector<Network::Client*> res;
+    if (g_mng_th && g_mng_th->ptr())
+        res.push_back(g_mng_th->ptr());
+    for (NetworkClientThread::Type* thread: mirror_th_)
+        if (thread->ptr())
+            res.push_back(thread->ptr());
+    return res;
+}
+
+QString Worker::getNetworkStats()
+{
+    if (!g_mng_th || !g_mng_th->ptr())
+        return {};
+    QJsonObject json = g_mng_th->ptr()->packStats();
+
+    QJsonArray mirrors;
+    for (NetworkClientThread::Type* thread: mirror_th_)
+        mirrors.push_back(thread->ptr()->packStats());
+    if (!mirrors.isEmpty())
+        json["mirrors"] = mirrors;
+
+    return QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+QString Worker::getScriptStats()
+{
+    if (!prj || !prj->ptr())
+        return {};
+    return QJsonDocument(prj->ptr()->profiler().stats(20)).toJson(QJsonDocument::Compact);
+}
+
 void Worker::initDevice(const QString &device, const QString &device_name, const QString &device_latin, const QString &device_desc)
 {
     QUuid devive_uuid(device);
@@ -464,6 +751,12 @@ void Worker::saveServerAuthData(const QString &login, const QString &password)
     saveServerData(g_mng_th->ptr()->device(), login, password);
 }
 
+void Worker::clearAuthCache()
+{
+    if (auth_cache_)
+        auth_cache_->clear();
+}
+
 void Worker::saveServerData(const QUuid &devive_uuid, const QString &login, const QString &password)
 {
     auto s = settings();
@@ -504,6 +797,7 @@ bool Worker::setDayTime(uint section_id, uint dayStartSecs, uint dayEndSecs)
             {
                 *sct->dayTime() = tempRange;
                 prj->ptr()->dayTimeChanged(/*sct*/);
+                emit structureChanged();
             }
     }
     return res;
@@ -556,6 +850,7 @@ bool Worker::setCode(const CodeItem& item)
         *code = item;
     else
         CodeMng.add(item);
+    emit structureChanged();
     return db_mng->setCodes(&CodeMng);
 }
 
@@ -567,6 +862,7 @@ void Worker::setParamValues(const ParamValuesPack &pack)
     for (const ParamValueItem& item: pack)
         db_mng->saveParamValue(item.first, item.second);
     emit paramValuesChanged(pack);
+    emit structureChanged();
 }
 
 bool Worker::applyStructModify(quint8 structType, QDataStream *msg)
@@ -619,23 +915,50 @@ void Worker::newValue(DeviceItem *item)
     if (!item_values_timer.isActive())
         item_values_timer.start();
 
+    db_mng->rollupValue(item->id(), cur_date.toMSecsSinceEpoch(), item->getValue());
+
     QVariant db_id;
     bool immediately = prj->ptr()->ItemTypeMng.saveAlgorithm(item->type()) == ItemType::saSaveImmediately;
-    if (immediately && !db_mng->logChanges(item, cur_date, &db_id))
+    if (immediately && !db_mng->logValue(item, cur_date, &db_id))
     {
         qWarning(Service::Log) << "Упущенное значение:" << item->toString() << item->getValue().toString();
         // TODO: Error event
     } else if (prj->ptr()->ItemTypeMng.saveAlgorithm(item->type()) == ItemType::saInvalid)
         qWarning(Service::Log) << "Неправильный параметр сохранения" << item->toString();
 
+    quint8 flags = immediately ? ValueBatch::Immediately : 0;
+    if (coalesce_item_types_.find(item->type()) != coalesce_item_types_.cend())
+        flags |= ValueBatch::Coalesce;
+    if (websock_coalesce_item_types_.find(item->type()) != websock_coalesce_item_types_.cend())
+        flags |= ValueBatch::WebSockCoalesce;
+
     ValuePackItem pack_item{db_id.toUInt(), item->id(), cur_date.toMSecsSinceEpoch(), item->getRawValue(), item->getValue()};
     emit change(pack_item, immediately);
 
-    if (webSock_th) {
-        QVector<Dai::ValuePackItem> pack{pack_item};
-        QMetaObject::invokeMethod(webSock_th->ptr(), "sendDeviceItemValues", Qt::QueuedConnection,
-                                  QArgument<project::info>("ProjInfo", websock_item.get()), Q_ARG(QVector<Dai::ValuePackItem>, pack));
-    }
+    tick_values_.push_back(pack_item);
+    tick_flags_.push_back(flags);
+
+    // Срочное значение не ждёт конца такта, уходит вместе с уже собранными
+    if (immediately)
+        sendValueBatch();
+    else if (!tick_timer_.isActive())
+        tick_timer_.start();
+}
+
+void Worker::sendValueBatch()
+{
+    tick_timer_.stop();
+    if (tick_values_.isEmpty())
+        return;
+
+    ValueBatchPtr batch = std::make_shared<const ValueBatch>(std::move(tick_values_), std::move(tick_flags_));
+    tick_values_.clear();
+    tick_flags_.clear();
+
+    emit valueBatch(batch);
+
+    if (websock_item)
+        websock_item->sendValues(batch);
 }
 
 /*void Worker::sendLostValues(const QVector<quint32> &ids)
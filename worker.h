@@ -2,13 +2,21 @@
 #define WORKER_H
 
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QHash>
+
+#include <set>
+#include <vector>
 
 #include <Helpz/service.h>
 #include <Helpz/settingshelper.h>
 
 #include "Database/db_manager.h"
+#include "Database/log_compactor.h"
 #include "checker.h"
 #include "Network/n_client.h"
+#include "Network/value_batch.h"
+#include "Network/cached_call.h"
 #include "Scripts/scriptedproject.h"
 
 #include "plus/dai/djangohelper.h"
@@ -18,20 +26,60 @@
 namespace Dai {
 class Worker;
 
+// Команды WebSocket, которых нет в Dai/commands.h
+enum WebSockExtCmd : quint8 {
+    // quint32 request_id, quint64 run_id, quint64 seq, bool full, QVector<ValuePackItem>
+    wsValuesSnapshot = 0xF0,
+    // quint64 run_id, quint64 seq - номер кадра значений, ушедшего прямо перед ним
+    wsValuesSeq = 0xF1,
+};
+
 class WebSockItem : public QObject, public project::base
 {
     Q_OBJECT
 public:
-    WebSockItem(Worker* obj);
+    WebSockItem(Worker* obj, int max_frame_rate);
     ~WebSockItem();
 
 signals:
     void send(const ProjInfo &proj, const QByteArray& data) const;
+    // Ответ на wsConnectInfo, собирается в потоке WebSocket
+    void connectInfo(const QByteArray& snapshot) const;
 public slots:
     void modeChanged(uint mode_id, uint group_id);
     void procCommand(quint32 user_team_id, quint32 proj_id, quint8 cmd, const QByteArray& data);
+
+    // Не чаще max_frame_rate раз в секунду, значения за это время уходят одним кадром.
+    // Ограничение общее для проекта: WebSocket отправляет кадр всем подключениям сразу,
+    // своей частоты и подписки на элементы у отдельного клиента нет
+    void sendValues(const ValueBatchPtr& batch);
+private slots:
+    void sendValuesFrame();
 private:
+    // Значения, изменившиеся после кадра since_seq. WebSocket не умеет отправить
+    // одному подключению, снимок получают все вкладки проекта, поэтому полный снимок
+    // не отправляется: для нового клиента или since_seq из другого запуска
+    // ответ без значений с full = true, начальные значения клиент берёт как раньше
+    QByteArray snapshot(quint32 request_id, quint64 run_id, quint64 since_seq) const;
+
     Worker* w;
+
+    int frame_interval_ms_;
+    QTimer frame_timer_;
+    QElapsedTimer last_frame_;
+    QVector<ValuePackItem> values_;
+    QHash<quint32, int> latest_; // индекс в values_ для типов с WebSockCoalesce
+
+    // Каждый кадр со значениями получает следующий номер, клиент считает кадры
+    // после снимка и при переподключении присылает номер последнего.
+    // Номера начинаются заново при каждом запуске, поэтому запуск отличается по run_id_
+    quint64 run_id_;
+    struct LastValue {
+        quint64 seq;
+        ValuePackItem item;
+    };
+    quint64 seq_ = 0;
+    std::map<quint32, LastValue> last_values_;
 };
 
 class Worker final : public QObject
@@ -42,11 +90,13 @@ public:
     ~Worker();
 
     const Helpz::Database::ConnectionInfo& database_info() const;
+    std::shared_ptr<LogArchive> log_archive() const;
 
     static std::unique_ptr<QSettings> settings();
 private:
     int init_logging(QSettings* s);
     void init_Database(QSettings *s);
+    void init_LogArchive(QSettings *s);
     void init_Project(QSettings* s);
     void init_Checker(QSettings* s);
     void init_GlobalClient(QSettings* s);
@@ -63,6 +113,7 @@ signals:
     // D-BUS Signals
     void started();
     void change(const Dai::ValuePackItem& item, bool immediately);
+    void valueBatch(const Dai::ValueBatchPtr& batch);
 
     void modeChanged(uint mode_id, uint group_id);
     void groupStatusChanged(quint32 group_id, quint32 status);
@@ -71,6 +122,8 @@ signals:
     void statusRemoved(quint32 group_id, quint32 info_id);
 
     void paramValuesChanged(const ParamValuesPack& pack);
+    // Изменены секции, коды или параметры проекта
+    void structureChanged();
 
 //    std::shared_ptr<Dai::Prt::ServerInfo> dumpSectionsInfo() const;
 public slots:
@@ -79,12 +132,19 @@ public slots:
 
     QString getUserDevices();
     QString getUserStatus();
+    QString getLogRollup(quint32 item_id, qint64 from_ms, qint64 to_ms, qint64 step_ms);
+    QString getArchivedValues(quint32 item_id, qint64 from_ms, qint64 to_ms);
+    QString getNetworkStats();
+    QString getScriptStats();
 
     void initDevice(const QString& device, const QString& device_name, const QString &device_latin, const QString& device_desc);
     void clearServerConfig();
     void saveServerAuthData(const QString& login, const QString& password);
     void saveServerData(const QUuid &devive_uuid, const QString& login, const QString& password);
 
+    // Вызывается при отзыве токена или выходе пользователя, чтобы кэш не пропускал его дальше
+    void clearAuthCache();
+
     QByteArray sections();
     bool setDayTime(uint section_id, uint dayStartSecs, uint dayEndSecs);
 
@@ -99,6 +159,8 @@ public slots:
 //    bool setSettings(uchar stType, google::protobuf::Message* msg);
 public slots:
     void newValue(DeviceItem* item);
+private slots:
+    void sendValueBatch();
 
 //    std::shared_ptr<Prt::ServerInfo> serverInfo() const;
 
@@ -108,11 +170,22 @@ private:
     std::unique_ptr<Helpz::Database::ConnectionInfo> db_info_;
     DBManager* db_mng;
 
+    std::shared_ptr<LogArchive> log_archive_;
+
+    // Типы элементов, для которых на сервер и в WebSocket уходит только последнее значение в пакете.
+    // По умолчанию пусто, промежуточные значения не теряются
+    std::set<uint> coalesce_item_types_, websock_coalesce_item_types_;
+    using LogCompactorThread = Helpz::SettingsThreadHelper<LogCompactor, Worker*, int, int>;
+    LogCompactorThread::Type* log_compactor_th = nullptr;
+
     friend class Network::Client;
-    using NetworkClientThread = Helpz::SettingsThreadHelper<Network::Client, Worker*, QString, quint16, QString, QString, QUuid, int>;
+    using NetworkClientThread = Helpz::SettingsThreadHelper<Network::Client, Worker*, bool, QString, quint16, QString, QString, QUuid, int, int, int, int, int, bool, QString, int>;
     NetworkClientThread::Type* g_mng_th;
+    std::vector<NetworkClientThread::Type*> mirror_th_;
+    // Основной клиент и зеркала, каждый собирает свои пакеты
+    std::vector<Network::Client*> clients() const;
 
-    using ScriptsThread = Helpz::SettingsThreadHelper<ScriptedProject, Worker*, Helpz::ConsoleReader*, QString, bool>;
+    using ScriptsThread = Helpz::SettingsThreadHelper<ScriptedProject, Worker*, Helpz::ConsoleReader*, QString, bool, int, int, int>;
     ScriptsThread::Type* prj;
 
     friend class Checker;
@@ -126,10 +199,17 @@ private:
     WebSocketThread::Type* webSock_th = nullptr;
     friend class WebSockItem;
 
+    typedef Network::CachedCall<decltype(&DjangoHelper::checkToken)> CheckTokenCall;
+    std::unique_ptr<CheckTokenCall> auth_cache_;
+
     QTimer logTimer;
 
     std::map<quint32, std::pair<QVariant, QVariant>> waited_item_values;
     QTimer item_values_timer;
+
+    QTimer tick_timer_;
+    QVector<ValuePackItem> tick_values_;
+    QVector<quint8> tick_flags_;
 };
 
 typedef Helpz::Service::Impl<Worker> Service;